@@ -0,0 +1,87 @@
+#ifndef BENCH_CORPUS_H
+#define BENCH_CORPUS_H
+
+#include <string.h>
+
+/* Requests as real clients send them, for the benchmarks to parse. The
+ * hostile ones are built at run time by the benchmark itself.
+ */
+typedef struct {
+    const char *name;
+    const char *text;
+} capture_t;
+
+static const capture_t corpus[] = {
+    {"curl",
+     "GET / HTTP/1.1\r\n"
+     "Host: localhost:8081\r\n"
+     "User-Agent: curl/8.5.0\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"ab",
+     "GET /index.html HTTP/1.0\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "User-Agent: ApacheBench/2.3\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"wget",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "User-Agent: Wget/1.21.4\r\n"
+     "Accept: */*\r\n"
+     "Accept-Encoding: identity\r\n"
+     "Connection: Keep-Alive\r\n"
+     "\r\n"},
+    /* what a browser sends; cookies and the user agent make up most of it */
+    {"browser",
+     "GET /index.html?utm_source=newsletter HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+     "like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/"
+     "avif,image/webp,image/apng,*/*;q=0.8\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: en-US,en;q=0.9,zh-TW;q=0.8\r\n"
+     "Cache-Control: max-age=0\r\n"
+     "Connection: keep-alive\r\n"
+     "Cookie: session=8f1c2d3e4b5a69788796a5b4c3d2e1f0; _ga=GA1.2.1234567890."
+     "1700000000; _gid=GA1.2.987654321.1700000000; preferences=eyJ0aGVtZSI6Im"
+     "RhcmsiLCJsYW5nIjoiZW4iLCJ0eiI6IkFzaWEvVGFpcGVpIiwiZm9udCI6Im1vbm8ifQ; "
+     "cart=W3siaWQiOjEyMywicXR5IjoyfSx7ImlkIjo0NTYsInF0eSI6MX0seyJpZCI6Nzg5LC"
+     "JxdHkiOjV9XQ; ab_test=variant_b; csrftoken=Zm9vYmFyYmF6cXV4cXV1eGNvcmdl"
+     "Z3JhdWx0Z2FycGx5d2FsZG9m; tracking_id=0123456789abcdef0123456789abcdef"
+     "\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "\r\n"},
+    /* the same page reloaded, with the validators from the first visit */
+    {"revalidate",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+     "Firefox/128.0\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0."
+     "8\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Connection: keep-alive\r\n"
+     "If-Modified-Since: Sat, 29 Jun 2024 08:15:27 GMT\r\n"
+     "If-None-Match: \"667fc2ef-1a9\"\r\n"
+     "Cache-Control: max-age=0\r\n"
+     "\r\n"},
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static inline const char *corpus_find(const char *name)
+{
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        if (!strcmp(corpus[i].name, name))
+            return corpus[i].text;
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,704 @@
+/* HTTP load generator on io_uring. Every thread runs one ring driving its
+ * share of the connections, either closed loop (a connection sends its next
+ * request as soon as the previous response is complete) or open loop at a
+ * fixed aggregate rate. Latencies go into a log-linear histogram and the
+ * result is printed as JSON, ready to be kept as a baseline and compared
+ * against with -b.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of memmem(3) */
+#endif
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_URLS 16
+#define MAX_THREADS 64
+#define RECV_LEN 16384
+#define REQUEST_LEN 512
+#define RETRY_NS 10000000ULL /* back off after a failed connection */
+
+/* Log-linear histogram in nanoseconds: exact below 128, then 64 buckets per
+ * power of two, so any value is reported within 1.6% over the full range.
+ */
+#define SUB_BITS 6
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS (2 * SUB_COUNT + (63 - SUB_BITS) * SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, min, max;
+    double sum;
+} histogram_t;
+
+static int hist_index(uint64_t v)
+{
+    if (v < 2 * SUB_COUNT)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return 2 * SUB_COUNT + (shift - 1) * SUB_COUNT + (v >> shift) - SUB_COUNT;
+}
+
+/* highest value that lands in bucket @i */
+static uint64_t hist_value(int i)
+{
+    if (i < 2 * SUB_COUNT)
+        return i;
+    int shift = (i - 2 * SUB_COUNT) / SUB_COUNT + 1;
+    uint64_t sub = (i - 2 * SUB_COUNT) % SUB_COUNT + SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    if (!h->total || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->total++;
+    h->sum += v;
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    if (!src->total)
+        return;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    if (!dst->total || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double p)
+{
+    if (!h->total)
+        return 0;
+
+    uint64_t rank = h->total * p / 100.0, seen = 0;
+    if (rank >= h->total)
+        rank = h->total - 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+typedef struct {
+    const char *path;
+    unsigned weight;
+    char request[REQUEST_LEN];
+    size_t request_len;
+} url_t;
+
+enum { OP_CONNECT, OP_SEND, OP_RECV, OP_WAIT, OP_END };
+
+typedef struct {
+    int fd;
+    const url_t *url;
+    size_t sent;
+    uint64_t start; /* when the request was (supposed to be) sent */
+    uint64_t next;  /* open loop: when the next request is due */
+    /* response being received */
+    size_t have;         /* header bytes in buf */
+    bool in_body;
+    long long body_left; /* -1: delimited by the connection closing */
+    int status;
+    bool server_close;
+    struct __kernel_timespec ts;
+    char buf[RECV_LEN];
+} conn_t;
+
+typedef struct {
+    int id;
+    int nr_conns;
+    pthread_t tid;
+    struct io_uring ring;
+    conn_t *conns;
+    uint64_t interval; /* open loop: per-connection spacing in ns */
+    uint64_t warmup_end, end;
+    uint32_t seed;
+    bool done;
+    struct __kernel_timespec end_ts;
+    /* results, counted after the warm-up only */
+    histogram_t hist;
+    uint64_t requests, errors, bytes;
+    uint64_t status[6]; /* by class, index 0 for anything unparsable */
+} worker_t;
+
+static struct sockaddr_in server;
+static url_t urls[MAX_URLS];
+static int nr_urls;
+static unsigned weight_sum;
+static bool keep_alive = true;
+static double rate; /* requests per second, 0 for closed loop */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ns_to_ts(struct __kernel_timespec *ts, uint64_t ns)
+{
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static inline uint64_t pack(int op, int idx)
+{
+    return (uint64_t) op << 56 | (uint32_t) idx;
+}
+
+static struct io_uring_sqe *get_sqe(worker_t *w)
+{
+    struct io_uring_sqe *sqe;
+    while (!(sqe = io_uring_get_sqe(&w->ring)))
+        io_uring_submit(&w->ring);
+    return sqe;
+}
+
+static const url_t *pick_url(worker_t *w)
+{
+    if (nr_urls == 1)
+        return &urls[0];
+
+    /* xorshift32 */
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    unsigned n = w->seed % weight_sum;
+    for (int i = 0; i < nr_urls; i++) {
+        if (n < urls[i].weight)
+            return &urls[i];
+        n -= urls[i].weight;
+    }
+    return &urls[nr_urls - 1];
+}
+
+static void queue_send(worker_t *w, conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_send(sqe, c->fd, c->url->request + c->sent,
+                       c->url->request_len - c->sent, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, pack(OP_SEND, c - w->conns));
+}
+
+static void queue_recv(worker_t *w, conn_t *c)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    if (c->in_body)
+        io_uring_prep_recv(sqe, c->fd, c->buf, RECV_LEN, 0);
+    else
+        io_uring_prep_recv(sqe, c->fd, c->buf + c->have, RECV_LEN - c->have,
+                           0);
+    io_uring_sqe_set_data64(sqe, pack(OP_RECV, c - w->conns));
+}
+
+static void queue_wait(worker_t *w, conn_t *c, uint64_t ns)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    ns_to_ts(&c->ts, ns);
+    io_uring_prep_timeout(sqe, &c->ts, 0, 0);
+    io_uring_sqe_set_data64(sqe, pack(OP_WAIT, c - w->conns));
+}
+
+static void start_request(worker_t *w, conn_t *c, uint64_t now)
+{
+    c->url = pick_url(w);
+    /* open loop latency counts from when the request was due, so a server
+     * that falls behind is not excused by the client waiting for it
+     */
+    c->start = rate > 0 ? c->next : now;
+    c->sent = 0;
+    c->have = 0;
+    c->in_body = false;
+    c->status = 0;
+    c->server_close = false;
+
+    if (c->fd >= 0) {
+        queue_send(w, c);
+        return;
+    }
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_connect(sqe, c->fd, (struct sockaddr *) &server,
+                          sizeof(server));
+    io_uring_sqe_set_data64(sqe, pack(OP_CONNECT, c - w->conns));
+}
+
+static void close_conn(conn_t *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/* Send the next request now or once it is due. */
+static void next_request(worker_t *w, conn_t *c, uint64_t delay)
+{
+    uint64_t now = now_ns();
+
+    if (rate > 0) {
+        /* a connection that fell behind catches up back to back, its
+         * requests still timed from when they were due
+         */
+        c->next += w->interval;
+        if (delay && c->next < now + delay)
+            c->next = now + delay;
+        delay = c->next > now ? c->next - now : 0;
+    }
+    if (delay)
+        queue_wait(w, c, delay);
+    else
+        start_request(w, c, now);
+}
+
+static void fail(worker_t *w, conn_t *c)
+{
+    if (now_ns() >= w->warmup_end)
+        w->errors++;
+    close_conn(c);
+    next_request(w, c, RETRY_NS);
+}
+
+static void complete(worker_t *w, conn_t *c)
+{
+    uint64_t now = now_ns();
+
+    if (now >= w->warmup_end) {
+        hist_record(&w->hist, now - c->start);
+        w->requests++;
+        w->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+    }
+    if (!keep_alive || c->server_close)
+        close_conn(c);
+    next_request(w, c, 0);
+}
+
+static bool header_is(const char *line, const char *end, const char *name)
+{
+    size_t len = strlen(name);
+    return end - line > (long) len && !strncasecmp(line, name, len);
+}
+
+/* Parse the status line and the headers that matter for framing. */
+static bool parse_header(conn_t *c, const char *end)
+{
+    const char *p = c->buf;
+    long long length = -1;
+
+    if (strncmp(p, "HTTP/1.", 7) || end - p < 12)
+        return false;
+    c->status = atoi(p + 9);
+
+    while ((p = memchr(p, '\n', end - p)) && ++p < end) {
+        if (header_is(p, end, "Content-Length:"))
+            length = strtoll(p + 15, NULL, 10);
+        else if (header_is(p, end, "Connection:")) {
+            const char *v = p + 11;
+            while (*v == ' ')
+                v++;
+            if (!strncasecmp(v, "close", 5))
+                c->server_close = true;
+        }
+    }
+
+    if (c->status == 204 || c->status == 304 || c->status < 200)
+        length = 0;
+    c->body_left = length;
+    return true;
+}
+
+static void on_recv(worker_t *w, conn_t *c, int res)
+{
+    if (res <= 0) {
+        /* a body without Content-Length ends with the connection */
+        if (res == 0 && c->in_body && c->body_left < 0) {
+            c->server_close = true;
+            complete(w, c);
+        } else {
+            fail(w, c);
+        }
+        return;
+    }
+    if (now_ns() >= w->warmup_end)
+        w->bytes += res;
+
+    if (c->in_body) {
+        if (c->body_left >= 0)
+            c->body_left -= res;
+    } else {
+        c->have += res;
+        char *hdr_end = memmem(c->buf, c->have, "\r\n\r\n", 4);
+        if (!hdr_end) {
+            if (c->have == RECV_LEN)
+                fail(w, c);
+            else
+                queue_recv(w, c);
+            return;
+        }
+        hdr_end += 4;
+        if (!parse_header(c, hdr_end)) {
+            fail(w, c);
+            return;
+        }
+        c->in_body = true;
+        if (c->body_left > 0)
+            c->body_left -= c->have - (hdr_end - c->buf);
+    }
+
+    if (c->body_left > 0 || c->body_left < 0)
+        queue_recv(w, c);
+    else
+        complete(w, c);
+}
+
+static void handle(worker_t *w, struct io_uring_cqe *cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    int op = data >> 56;
+    conn_t *c = &w->conns[(uint32_t) data];
+
+    if (op == OP_END) {
+        w->done = true;
+        return;
+    }
+    if (w->done)
+        return;
+
+    switch (op) {
+    case OP_CONNECT:
+        if (cqe->res < 0)
+            fail(w, c);
+        else
+            queue_send(w, c);
+        break;
+    case OP_SEND:
+        if (cqe->res <= 0) {
+            fail(w, c);
+            break;
+        }
+        c->sent += cqe->res;
+        if (c->sent < c->url->request_len)
+            queue_send(w, c);
+        else
+            queue_recv(w, c);
+        break;
+    case OP_RECV:
+        on_recv(w, c, cqe->res);
+        break;
+    case OP_WAIT:
+        start_request(w, c, now_ns());
+        break;
+    }
+}
+
+static void *worker_loop(void *arg)
+{
+    worker_t *w = arg;
+    unsigned entries = 1;
+
+    while (entries < 2 * (unsigned) w->nr_conns + 8)
+        entries <<= 1;
+    int ret = io_uring_queue_init(entries, &w->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        exit(1);
+    }
+
+    uint64_t t0 = now_ns();
+    struct io_uring_sqe *sqe = get_sqe(w);
+    ns_to_ts(&w->end_ts, w->end - t0);
+    io_uring_prep_timeout(sqe, &w->end_ts, 0, 0);
+    io_uring_sqe_set_data64(sqe, pack(OP_END, 0));
+
+    for (int i = 0; i < w->nr_conns; i++) {
+        conn_t *c = &w->conns[i];
+        c->fd = -1;
+        /* spread the first requests over one interval */
+        c->next = t0 + w->interval * i / w->nr_conns;
+        if (rate > 0 && c->next > t0)
+            queue_wait(w, c, c->next - t0);
+        else
+            start_request(w, c, t0);
+    }
+
+    while (!w->done) {
+        struct io_uring_cqe *cqe;
+        unsigned head, count = 0;
+
+        io_uring_submit_and_wait(&w->ring, 1);
+        io_uring_for_each_cqe(&w->ring, head, cqe)
+        {
+            handle(w, cqe);
+            count++;
+        }
+        io_uring_cq_advance(&w->ring, count);
+    }
+
+    for (int i = 0; i < w->nr_conns; i++)
+        close_conn(&w->conns[i]);
+    io_uring_queue_exit(&w->ring);
+    return NULL;
+}
+
+static int add_url(const char *arg)
+{
+    if (nr_urls == MAX_URLS)
+        return -1;
+
+    url_t *u = &urls[nr_urls];
+    char *spec = strdup(arg);
+    char *colon = strrchr(spec, ':');
+    u->weight = 1;
+    if (colon && colon[1] && strspn(colon + 1, "0123456789") ==
+                                 strlen(colon + 1)) {
+        *colon = '\0';
+        u->weight = atoi(colon + 1);
+    }
+    if (spec[0] != '/' || !u->weight)
+        return -1;
+    u->path = spec;
+    weight_sum += u->weight;
+    nr_urls++;
+    return 0;
+}
+
+static void render_requests(const char *host, int port)
+{
+    for (int i = 0; i < nr_urls; i++) {
+        url_t *u = &urls[i];
+        int n = snprintf(u->request, REQUEST_LEN,
+                         "GET %s HTTP/1.1\r\n"
+                         "Host: %s:%d\r\n"
+                         "User-Agent: sehttpd-loadgen\r\n"
+                         "%s\r\n",
+                         u->path, host, port,
+                         keep_alive ? "" : "Connection: close\r\n");
+        if (n >= REQUEST_LEN) {
+            fprintf(stderr, "URL too long: %s\n", u->path);
+            exit(1);
+        }
+        u->request_len = n;
+    }
+}
+
+/* Pull "key": number out of an earlier result; good enough for our own
+ * output, which is all -b is meant to read.
+ */
+static double json_number(const char *json, const char *key)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(json, pattern);
+    return p ? strtod(p + strlen(pattern), NULL) : 0;
+}
+
+static void compare(const char *path, double rps, const double *lat)
+{
+    static const char *keys[] = {"p50", "p99", "p99.9"};
+    char json[4096];
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return;
+    }
+    size_t n = fread(json, 1, sizeof(json) - 1, f);
+    json[n] = '\0';
+    fclose(f);
+
+    double base = json_number(json, "throughput_rps");
+    fprintf(stderr, "vs %s:\n", path);
+    if (base > 0)
+        fprintf(stderr, "  throughput %10.0f -> %10.0f req/s  %+6.1f%%\n",
+                base, rps, (rps - base) * 100 / base);
+    for (int i = 0; i < 3; i++) {
+        base = json_number(json, keys[i]);
+        if (base > 0)
+            fprintf(stderr, "  %-10s %10.1f -> %10.1f us     %+6.1f%%\n",
+                    keys[i], base, lat[i], (lat[i] - base) * 100 / base);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a ADDR    server address (default 127.0.0.1)\n"
+            "  -p PORT    server port (default 8081)\n"
+            "  -c N       connections (default 64)\n"
+            "  -t N       threads, one ring each (default 1)\n"
+            "  -d SEC     measured duration (default 10)\n"
+            "  -W SEC     warm-up before measuring (default 1)\n"
+            "  -R RATE    open loop at RATE requests/s in total; "
+            "closed loop if 0 (default)\n"
+            "  -n         new connection for every request\n"
+            "  -u PATH[:WEIGHT]\n"
+            "             URL to request, repeat for a mix (default /)\n"
+            "  -b FILE    compare with an earlier result\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1", *baseline = NULL;
+    int port = 8081, nr_conns = 64, nr_threads = 1;
+    double duration = 10, warmup = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:c:t:d:W:R:nu:b:h")) != -1) {
+        switch (opt) {
+        case 'a':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nr_conns = atoi(optarg);
+            break;
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'W':
+            warmup = atof(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            keep_alive = false;
+            break;
+        case 'u':
+            if (add_url(optarg) < 0) {
+                fprintf(stderr, "bad URL: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (nr_threads < 1 || nr_threads > MAX_THREADS || nr_conns < nr_threads ||
+        duration <= 0 || warmup < 0 || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!nr_urls)
+        add_url("/");
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", host);
+        return 1;
+    }
+    render_requests(host, port);
+
+    static worker_t workers[MAX_THREADS];
+    uint64_t start = now_ns();
+    uint64_t warmup_end = start + warmup * 1e9;
+    for (int i = 0; i < nr_threads; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->nr_conns = nr_conns / nr_threads + (i < nr_conns % nr_threads);
+        w->conns = calloc(w->nr_conns, sizeof(conn_t));
+        if (!w->conns) {
+            perror("calloc");
+            return 1;
+        }
+        if (rate > 0)
+            w->interval = 1e9 * nr_conns / rate;
+        w->warmup_end = warmup_end;
+        w->end = warmup_end + duration * 1e9;
+        w->seed = 2463534242u + i;
+        pthread_create(&w->tid, NULL, worker_loop, w);
+    }
+
+    static histogram_t hist;
+    uint64_t requests = 0, errors = 0, bytes = 0, status[6] = {0};
+    for (int i = 0; i < nr_threads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        hist_merge(&hist, &w->hist);
+        requests += w->requests;
+        errors += w->errors;
+        bytes += w->bytes;
+        for (int j = 0; j < 6; j++)
+            status[j] += w->status[j];
+    }
+
+    double rps = requests / duration;
+    double lat[] = {hist_percentile(&hist, 50) / 1e3,
+                    hist_percentile(&hist, 99) / 1e3,
+                    hist_percentile(&hist, 99.9) / 1e3};
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", rate > 0 ? "open" : "closed");
+    printf("  \"rate\": %.0f,\n", rate);
+    printf("  \"connections\": %d,\n", nr_conns);
+    printf("  \"threads\": %d,\n", nr_threads);
+    printf("  \"keep_alive\": %s,\n", keep_alive ? "true" : "false");
+    printf("  \"duration_s\": %.1f,\n", duration);
+    printf("  \"urls\": [");
+    for (int i = 0; i < nr_urls; i++)
+        printf("%s{\"path\": \"%s\", \"weight\": %u}", i ? ", " : "",
+               urls[i].path, urls[i].weight);
+    printf("],\n");
+    printf("  \"requests\": %" PRIu64 ",\n", requests);
+    printf("  \"errors\": %" PRIu64 ",\n", errors);
+    printf("  \"status\": {\"1xx\": %" PRIu64 ", \"2xx\": %" PRIu64
+           ", \"3xx\": %" PRIu64 ", \"4xx\": %" PRIu64 ", \"5xx\": %" PRIu64
+           ", \"other\": %" PRIu64 "},\n",
+           status[1], status[2], status[3], status[4], status[5], status[0]);
+    printf("  \"throughput_rps\": %.1f,\n", rps);
+    printf("  \"throughput_mbps\": %.2f,\n", bytes * 8 / duration / 1e6);
+    printf("  \"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+           "\"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}\n",
+           hist.min / 1e3, hist.total ? hist.sum / hist.total / 1e3 : 0,
+           lat[0], hist_percentile(&hist, 90) / 1e3, lat[1], lat[2],
+           hist.max / 1e3);
+    printf("}\n");
+    fflush(stdout);
+
+    if (baseline)
+        compare(baseline, rps, lat);
+    return 0;
+}
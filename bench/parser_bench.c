@@ -0,0 +1,233 @@
+/* Header scanner: checks the request parser with each implementation of
+ * the scan against a build of it that steps through every byte, on the
+ * corpus and on random requests fed in random pieces, then measures how
+ * many cycles per byte the request line and header parser spend on each.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "corpus.h"
+#include "http.h"
+#include "http_scan.h"
+
+#define BUF_LEN 4096
+#define FUZZ_CASES 200000
+#define CORPUS_CASES 20000
+#define MAX_PIECES 4
+#define ITERATIONS 200000
+
+/* bench/parser_step.c */
+int http_step_request_line(http_request_t *r);
+int http_step_request_body(http_request_t *r);
+
+typedef struct {
+    int (*line)(http_request_t *r);
+    int (*body)(http_request_t *r);
+} parser_t;
+
+static const parser_t stepping = {http_step_request_line,
+                                  http_step_request_body};
+static const parser_t scanning = {http_parse_request_line,
+                                  http_parse_request_body};
+
+static const char *impl_names[] = {"scalar", "sse4.2", "avx2"};
+
+/* where the parser is after one piece */
+typedef struct {
+    int line_rc, body_rc;
+    size_t pos;
+    int state, method;
+    long uri_start, uri_end, request_end;
+    long cur[4];
+    int nr_headers;
+    long spans[64][4];
+} outcome_t;
+
+static char buf[BUF_LEN];
+
+static long offset(void *p)
+{
+    return p ? (char *) p - buf : -1;
+}
+
+/* Parse the first @len bytes of buf in place, handed over in @n pieces
+ * that end at @ends, the last one at @len, like receives that each extend
+ * r->last, and record the outcome after each piece.
+ */
+static void parse(const parser_t *ps,
+                  const size_t *ends,
+                  int n,
+                  outcome_t *o)
+{
+    http_request_t r;
+    int phase = 0; /* request line, headers, done */
+
+    memset(&r, 0, sizeof(r));
+    INIT_LIST_HEAD(&r.list);
+    arena_init(&r.arena);
+    r.buf = buf;
+
+    memset(o, 0, n * sizeof(*o));
+    for (int i = 0; i < n; i++, o++) {
+        r.last = ends[i];
+        o->line_rc = o->body_rc = -1;
+        if (phase == 0) {
+            o->line_rc = ps->line(&r);
+            phase = o->line_rc == 0 ? 1 : o->line_rc == EAGAIN ? 0 : 2;
+        }
+        if (phase == 1) {
+            o->body_rc = ps->body(&r);
+            phase = o->body_rc == EAGAIN ? 1 : 2;
+        }
+        o->pos = r.pos;
+        o->state = r.state;
+        o->method = r.method;
+        o->uri_start = offset(r.uri_start);
+        o->uri_end = offset(r.uri_end);
+        o->request_end = offset(r.request_end);
+        o->cur[0] = offset(r.cur_header_key_start);
+        o->cur[1] = offset(r.cur_header_key_end);
+        o->cur[2] = offset(r.cur_header_value_start);
+        o->cur[3] = offset(r.cur_header_value_end);
+
+        list_head *pos;
+        list_for_each (pos, &r.list) {
+            http_header_t *hd = list_entry(pos, http_header_t, list);
+            if (o->nr_headers < 64) {
+                long *s = o->spans[o->nr_headers++];
+                s[0] = offset(hd->key_start);
+                s[1] = offset(hd->key_end);
+                s[2] = offset(hd->value_start);
+                s[3] = offset(hd->value_end);
+            }
+        }
+    }
+    arena_reset(&r.arena);
+}
+
+/* mostly delimiters, so that every state and every error path is hit */
+static size_t random_request(char *req)
+{
+    static const char alphabet[] = "GET /HTP1.0:  \r\n\r\nab";
+    size_t len = 0;
+
+    if (rand() % 4)
+        len = sprintf(req, "GET /%s HTTP/1.1\r\n", rand() % 2 ? "a" : "");
+    size_t n = rand() % 200;
+    for (size_t i = 0; i < n; i++)
+        req[len++] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    if (rand() % 2)
+        len += sprintf(req + len, "\r\n\r\n");
+    return len;
+}
+
+/* one to MAX_PIECES pieces, split at random points, empty ones included */
+static int random_pieces(size_t len, size_t *ends)
+{
+    int n = 1 + rand() % MAX_PIECES;
+
+    for (int i = 0; i < n - 1; i++)
+        ends[i] = (size_t) rand() % (len + 1);
+    ends[n - 1] = len;
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && ends[j - 1] > ends[j]; j--) {
+            size_t t = ends[j];
+            ends[j] = ends[j - 1];
+            ends[j - 1] = t;
+        }
+    }
+    return n;
+}
+
+/* @req parsed in the same pieces by both must come out the same */
+static bool compare(const char *name, const char *req, size_t len)
+{
+    outcome_t want[MAX_PIECES], got[MAX_PIECES];
+    size_t ends[MAX_PIECES];
+    int n = random_pieces(len, ends);
+
+    memcpy(buf, req, len);
+    parse(&stepping, ends, n, want);
+    parse(&scanning, ends, n, got);
+    for (int i = 0; i < n; i++) {
+        if (memcmp(&want[i], &got[i], sizeof(want[i]))) {
+            printf("%s: mismatch after %zu of %zu bytes of \"%.*s\"\n", name,
+                   ends[i], len, (int) len, req);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check(enum http_scan_impl impl)
+{
+    char req[BUF_LEN];
+
+    http_scan_init(impl);
+    srand(1);
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        const char *text = corpus[i].text;
+        for (int j = 0; j < CORPUS_CASES; j++) {
+            if (!compare(impl_names[impl], text, strlen(text)))
+                return false;
+        }
+    }
+    for (int i = 0; i < FUZZ_CASES; i++) {
+        size_t len = random_request(req);
+        if (!compare(impl_names[impl], req, len))
+            return false;
+    }
+    return true;
+}
+
+static unsigned long long cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void measure(const char *name, const parser_t *ps)
+{
+    const char *request = corpus_find("browser");
+    size_t len = strlen(request);
+    outcome_t o;
+
+    memcpy(buf, request, len); /* parsing does not modify it */
+    unsigned long long start = cycles();
+    for (int i = 0; i < ITERATIONS; i++)
+        parse(ps, &len, 1, &o);
+    double per_byte = (double) (cycles() - start) / ITERATIONS / len;
+
+    printf("%-7s %zu-byte request, %d headers: %5.2f cycles/byte\n", name,
+           len, o.nr_headers, per_byte);
+}
+
+int main()
+{
+    int ret = 0;
+
+    measure("step", &stepping);
+    for (int impl = HTTP_SCAN_SCALAR; impl <= HTTP_SCAN_AVX2; impl++) {
+        if (http_scan_init(impl) < 0) {
+            printf("%-7s not supported by this CPU\n", impl_names[impl]);
+            continue;
+        }
+        if (!check(impl)) {
+            ret = 1;
+            continue;
+        }
+        measure(impl_names[impl], &scanning);
+    }
+    return ret;
+}
@@ -0,0 +1,5 @@
+/* The request parser stepping through every byte, as the reference for the
+ * differential test in bench/parser_bench.c.
+ */
+#define HTTP_PARSER_STEP
+#include "http_parser.c"
@@ -0,0 +1,67 @@
+/* Microbenchmark for the per-worker request pool: cost of get_request() and
+ * free_request() with the pool empty, half full and nearly full.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "memory_pool.h"
+
+#define POOL_SIZE 8192 /* the old fixed Queue_Depth */
+#define ITERATIONS 10000000
+#define BATCH 64
+
+static http_request_t *held[POOL_SIZE];
+static http_request_t *batch[BATCH];
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(int percent)
+{
+    int nr_held = POOL_SIZE * percent / 100;
+    for (int i = 0; i < nr_held; i++)
+        held[i] = get_request();
+
+    /* back-to-back pairs: the accept/close pattern of short connections */
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++)
+        free_request(get_request());
+    double pair = (now_ns() - start) / ITERATIONS;
+
+    /* bursts: a batch of link timeouts armed and retired together */
+    start = now_ns();
+    for (int i = 0; i < ITERATIONS / BATCH; i++) {
+        for (int j = 0; j < BATCH; j++)
+            batch[j] = get_request();
+        for (int j = 0; j < BATCH; j++)
+            free_request(batch[j]);
+    }
+    double burst = (now_ns() - start) / (ITERATIONS / BATCH * BATCH);
+
+    printf("%3d%% occupied: %6.2f ns/pair, %6.2f ns/pair in bursts of %d\n",
+           percent, pair, burst, BATCH);
+
+    for (int i = 0; i < nr_held; i++)
+        free_request(held[i]);
+}
+
+int main()
+{
+    init_memorypool();
+
+    /* warm up so that every slab the runs touch already exists */
+    for (int i = 0; i < POOL_SIZE; i++)
+        held[i] = get_request();
+    for (int i = 0; i < POOL_SIZE; i++)
+        free_request(held[i]);
+
+    run(0);
+    run(50);
+    run(99);
+    return 0;
+}
@@ -0,0 +1,263 @@
+/* Per-request hot paths over the capture corpus plus a few hostile
+ * requests: request line and header parsing, header handling and URI
+ * mapping, and the request pool. Runs pinned to one CPU; every figure is
+ * the median of several timed rounds, with half the interquartile range
+ * as its spread, so that runs can be compared to within a few percent.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of sched_setaffinity(2) */
+#endif
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "corpus.h"
+#include "http.h"
+#include "memory_pool.h"
+
+#define BUF_LEN 4096 /* one receive buffer */
+#define MAX_HEADERS 256
+#define FILENAME_LEN 512 /* what serve_one() passes to http_parse_uri() */
+#define ROUNDS 11
+#define ROUND_NS 20000000 /* every round runs for at least 20 ms */
+
+typedef struct {
+    const char *name;
+    size_t len;
+    char buf[BUF_LEN]; /* parsed over and over */
+    http_request_t *r;
+    char kept[BUF_LEN]; /* parsed once, for the stages after parsing */
+    http_request_t *parsed;
+    http_header_t *headers[MAX_HEADERS];
+    int nr_headers;
+} sample_t;
+
+typedef void (*op_fn)(sample_t *s);
+
+static const char *webroot = "./www";
+
+static unsigned long long cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void op_request_line(sample_t *s)
+{
+    http_request_t *r = s->r;
+    r->pos = 0;
+    r->state = 0;
+    r->request_end = NULL;
+    http_parse_request_line(r);
+}
+
+static void op_parse(sample_t *s)
+{
+    http_request_t *r = s->r;
+    op_request_line(s);
+    INIT_LIST_HEAD(&r->list);
+    arena_reset(&r->arena);
+    http_parse_request_body(r);
+}
+
+/* the list is consumed, so it is put back together first */
+static void op_handle_header(sample_t *s)
+{
+    http_request_t *r = s->parsed;
+    http_out_t out = {.keep_alive = true, .modified = true, .status = 200};
+
+    INIT_LIST_HEAD(&r->list);
+    for (int i = 0; i < s->nr_headers; i++)
+        list_add_tail(&s->headers[i]->list, &r->list);
+    http_handle_header(r, &out);
+}
+
+static void op_parse_uri(sample_t *s)
+{
+    char filename[FILENAME_LEN];
+    http_request_t *r = s->parsed;
+    http_parse_uri(webroot, r->uri_start,
+                   (char *) r->uri_end - (char *) r->uri_start, filename);
+}
+
+static void op_pool(sample_t *s UNUSED)
+{
+    free_request(get_request());
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double run_round(op_fn op, sample_t *s, long iters, double *cyc)
+{
+    double start = now_ns();
+    unsigned long long c = cycles();
+    for (long i = 0; i < iters; i++)
+        op(s);
+    *cyc = (double) (cycles() - c) / iters;
+    return (now_ns() - start) / iters;
+}
+
+static void measure(const char *what, op_fn op, sample_t *s, size_t bytes)
+{
+    double ns[ROUNDS], cyc[ROUNDS], c;
+    long iters = 1000;
+
+    /* also warms up the caches and the branch predictor */
+    while (run_round(op, s, iters, &c) * iters < ROUND_NS)
+        iters *= 2;
+    for (int i = 0; i < ROUNDS; i++)
+        ns[i] = run_round(op, s, iters, &cyc[i]);
+
+    qsort(ns, ROUNDS, sizeof(double), cmp_double);
+    qsort(cyc, ROUNDS, sizeof(double), cmp_double);
+    double median = ns[ROUNDS / 2];
+    double spread = (ns[ROUNDS * 3 / 4] - ns[ROUNDS / 4]) / 2 / median * 100;
+
+    printf("  %-20s %9.1f ns/op", what, median);
+    if (bytes)
+        printf(" %7.2f cycles/byte", cyc[ROUNDS / 2] / bytes);
+    else
+        printf(" %19s", "");
+    printf("  +-%.1f%%\n", spread);
+}
+
+static void load(sample_t *s, const char *name, const char *text, size_t len)
+{
+    s->name = name;
+    s->len = len;
+    memcpy(s->buf, text, len);
+    memcpy(s->kept, text, len);
+
+    arena_reset(&s->r->arena);
+    arena_reset(&s->parsed->arena);
+    init_http_request(s->r, -1, (char *) webroot);
+    s->r->buf = s->buf;
+    s->r->last = len;
+
+    http_request_t *r = s->parsed;
+    init_http_request(r, -1, (char *) webroot);
+    r->buf = s->kept;
+    r->last = len;
+    if (http_parse_request_line(r) || http_parse_request_body(r)) {
+        fprintf(stderr, "%s: does not parse\n", name);
+        exit(1);
+    }
+
+    s->nr_headers = 0;
+    list_head *pos;
+    list_for_each (pos, &r->list) {
+        if (s->nr_headers < MAX_HEADERS)
+            s->headers[s->nr_headers++] =
+                list_entry(pos, http_header_t, list);
+    }
+}
+
+/* Requests no client would send but anyone can: one huge header, a flood
+ * of tiny ones, a URI close to the length limit.
+ */
+static size_t hostile(const char *name, char *req)
+{
+    size_t len = sprintf(req, "GET /");
+
+    if (!strcmp(name, "long-uri")) {
+        while (len < 240)
+            len += sprintf(req + len, "%%2e%%2e/");
+        len += sprintf(req + len, "etc/passwd");
+    }
+    len += sprintf(req + len, " HTTP/1.1\r\nHost: example.com\r\n");
+
+    if (!strcmp(name, "long-header")) {
+        len += sprintf(req + len, "X-Padding: ");
+        memset(req + len, 'A', 3000);
+        len += 3000;
+        len += sprintf(req + len, "\r\n");
+    } else if (!strcmp(name, "many-headers")) {
+        for (int i = 0; i < 200; i++)
+            len += sprintf(req + len, "X-%d: %d\r\n", i, i);
+    }
+    len += sprintf(req + len, "\r\n");
+    return len;
+}
+
+static void bench(sample_t *s)
+{
+    printf("%s: %zu bytes, %d headers\n", s->name, s->len, s->nr_headers);
+    measure("request line", op_request_line, s, s->len);
+    measure("line + headers", op_parse, s, s->len);
+    measure("http_handle_header", op_handle_header, s, s->len);
+    measure("http_parse_uri", op_parse_uri, s, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *hostile_names[] = {"long-header", "many-headers",
+                                          "long-uri"};
+    static sample_t s;
+    char req[BUF_LEN];
+    int cpu = sched_getcpu();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        if (opt != 'c') {
+            fprintf(stderr, "Usage: %s [-c cpu]\n", argv[0]);
+            return 1;
+        }
+        cpu = atoi(optarg);
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return 1;
+    }
+    printf("pinned to CPU %d, median of %d rounds\n", cpu, ROUNDS);
+
+    init_memorypool();
+    http_init();
+
+    s.r = calloc(1, sizeof(http_request_t));
+    s.parsed = calloc(1, sizeof(http_request_t));
+    if (!s.r || !s.parsed) {
+        perror("calloc");
+        return 1;
+    }
+    arena_init(&s.r->arena);
+    arena_init(&s.parsed->arena);
+
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        load(&s, corpus[i].name, corpus[i].text, strlen(corpus[i].text));
+        bench(&s);
+    }
+    for (size_t i = 0; i < sizeof(hostile_names) / sizeof(char *); i++) {
+        load(&s, hostile_names[i], req, hostile(hostile_names[i], req));
+        bench(&s);
+    }
+
+    printf("request pool\n");
+    measure("get + free", op_pool, &s, 0);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Print every sehttpd request batch slower than a threshold, with the time
+# spent in each stage and the file it resolved to, from the server's USDT
+# probes. Uses bcc (https://github.com/iovisor/bcc).
+#
+#   sudo ./ebpf/sehttpd-slow.py -p $(pgrep -n sehttpd) -t 1000
+#
+# Stages: recv..parse from the receive that started the batch to the end
+# of its first request's headers; parse..file to the last file lookup;
+# file..send to the send being queued; send..done until the last byte of
+# the batch is out, spliced bodies included.
+
+import argparse
+import ctypes as ct
+import time
+
+from bcc import BPF, USDT
+
+bpf_text = """
+#include <uapi/linux/ptrace.h>
+
+#define PATH_LEN 128
+
+struct conn_t {
+    u64 start, parsed, resolved, sending;
+    char path[PATH_LEN];
+};
+
+struct event_t {
+    u64 conn;
+    u64 start, parsed, resolved, sending, done;
+    u64 batch;
+    char path[PATH_LEN];
+};
+
+BPF_HASH(conns, u64, struct conn_t, 65536);
+BPF_PERF_OUTPUT(events);
+
+static struct conn_t *lookup(struct pt_regs *ctx, u64 *conn)
+{
+    bpf_usdt_readarg(1, ctx, conn);
+    return conns.lookup(conn);
+}
+
+int on_received(struct pt_regs *ctx)
+{
+    u64 conn = 0;
+    struct conn_t zero = {};
+    bpf_usdt_readarg(1, ctx, &conn);
+    struct conn_t *c = conns.lookup_or_try_init(&conn, &zero);
+    if (c && !c->start)
+        c->start = bpf_ktime_get_ns();
+    return 0;
+}
+
+int on_parsed(struct pt_regs *ctx)
+{
+    u64 conn = 0;
+    struct conn_t *c = lookup(ctx, &conn);
+    if (c && c->start && !c->parsed)
+        c->parsed = bpf_ktime_get_ns();
+    return 0;
+}
+
+int on_resolved(struct pt_regs *ctx)
+{
+    u64 conn = 0, path = 0;
+    struct conn_t *c = lookup(ctx, &conn);
+    if (!c || !c->start)
+        return 0;
+    c->resolved = bpf_ktime_get_ns();
+    bpf_usdt_readarg(2, ctx, &path);
+    bpf_probe_read_user_str(c->path, sizeof(c->path), (void *) path);
+    return 0;
+}
+
+int on_sending(struct pt_regs *ctx)
+{
+    u64 conn = 0;
+    struct conn_t *c = lookup(ctx, &conn);
+    if (c && c->start && !c->sending)
+        c->sending = bpf_ktime_get_ns();
+    return 0;
+}
+
+int on_done(struct pt_regs *ctx)
+{
+    u64 conn = 0;
+    struct conn_t *c = lookup(ctx, &conn);
+    if (!c)
+        return 0;
+
+    u64 now = bpf_ktime_get_ns();
+    if (c->start && now - c->start >= THRESHOLD_NS) {
+        struct event_t ev = {};
+        ev.conn = conn;
+        ev.start = c->start;
+        ev.parsed = c->parsed;
+        ev.resolved = c->resolved;
+        ev.sending = c->sending;
+        ev.done = now;
+        bpf_usdt_readarg(2, ctx, &ev.batch);
+        __builtin_memcpy(ev.path, c->path, sizeof(ev.path));
+        events.perf_submit(ctx, &ev, sizeof(ev));
+    }
+    conns.delete(&conn);
+    return 0;
+}
+
+int on_closed(struct pt_regs *ctx)
+{
+    u64 conn = 0;
+    bpf_usdt_readarg(1, ctx, &conn);
+    conns.delete(&conn);
+    return 0;
+}
+"""
+
+
+class Event(ct.Structure):
+    _fields_ = [
+        ("conn", ct.c_ulonglong),
+        ("start", ct.c_ulonglong),
+        ("parsed", ct.c_ulonglong),
+        ("resolved", ct.c_ulonglong),
+        ("sending", ct.c_ulonglong),
+        ("done", ct.c_ulonglong),
+        ("batch", ct.c_ulonglong),
+        ("path", ct.c_char * 128),
+    ]
+
+
+def span(a, b):
+    """microseconds from a to b, or '-' if a stage was never reached"""
+    return "%d" % ((b - a) // 1000) if a and b else "-"
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Trace slow sehttpd requests by stage")
+    parser.add_argument("-p", "--pid", type=int, help="server process")
+    parser.add_argument("-b", "--binary", default="./sehttpd",
+                        help="server binary when no pid is given")
+    parser.add_argument("-t", "--threshold", type=int, default=1000,
+                        help="report batches slower than this, in usec")
+    args = parser.parse_args()
+
+    usdt = USDT(pid=args.pid) if args.pid else USDT(path=args.binary)
+    for probe in ("received", "parsed", "resolved", "sending", "done",
+                  "closed"):
+        usdt.enable_probe(probe=probe, fn_name="on_" + probe)
+
+    text = bpf_text.replace("THRESHOLD_NS", "%dULL" % (args.threshold * 1000))
+    b = BPF(text=text, usdt_contexts=[usdt])
+
+    print("%-8s %-18s %8s %11s %11s %11s %11s %5s  %s" %
+          ("TIME", "CONN", "TOTAL", "recv..parse", "parse..file",
+           "file..send", "send..done", "BATCH", "FILE"))
+
+    def on_event(cpu, data, size):
+        ev = ct.cast(data, ct.POINTER(Event)).contents
+        print("%-8s %-18x %8d %11s %11s %11s %11s %5d  %s" %
+              (time.strftime("%H:%M:%S"), ev.conn,
+               (ev.done - ev.start) // 1000,
+               span(ev.start, ev.parsed), span(ev.parsed, ev.resolved),
+               span(ev.resolved, ev.sending), span(ev.sending, ev.done),
+               ev.batch, ev.path.decode("utf-8", "replace")))
+
+    b["events"].open_perf_buffer(on_event)
+    while True:
+        try:
+            b.perf_buffer_poll()
+        except KeyboardInterrupt:
+            break
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+# A stand-in upstream for scripts/test-proxy.sh: HTTP/1.1 with keep-alive on
+# a TCP port, or on a unix socket when the argument is a path.
+#   /len/N      N bytes with a Content-Length
+#   /chunked/N  N bytes in chunks of at most 1000
+#   /close/N    N bytes, delimited by closing the connection
+#   /conn       which connection this is, to see that connections are reused
+#   /echo       the request body back (POST)
+# under whatever prefix the proxy routes on. Every response carries the path
+# it was asked for in X-Path.
+
+import itertools
+import os
+import socketserver
+import sys
+from http.server import BaseHTTPRequestHandler
+
+connections = itertools.count(1)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    wbufsize = 65536  # one write per response, or delayed ACKs stall it
+
+    def setup(self):
+        super().setup()
+        self.conn_id = next(connections)
+
+    def log_message(self, format, *args):
+        pass
+
+    def address_string(self):
+        return "backend"
+
+    def reply(self, body, mode="len"):
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("X-Path", self.path)
+        if mode == "chunked":
+            self.send_header("Transfer-Encoding", "chunked")
+        elif mode == "close":
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        else:
+            self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command == "HEAD":
+            return
+        if mode == "chunked":
+            for i in range(0, len(body), 1000):
+                part = body[i:i + 1000]
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            self.wfile.write(b"0\r\nX-Trailer: yes\r\n\r\n")
+        else:
+            self.wfile.write(body)
+
+    def do_GET(self):
+        parts = self.path.split("?")[0].strip("/").split("/")
+        if len(parts) > 1 and parts[-2] in ("len", "chunked", "close"):
+            n = int(parts[-1])
+            self.reply((b"0123456789abcdef" * (n // 16 + 1))[:n], parts[-2])
+        elif parts[-1] == "conn":
+            self.reply(b"%d\n" % self.conn_id)
+        else:
+            self.reply(b"backend %s\n" % self.path.encode())
+
+    do_HEAD = do_GET
+
+    def do_POST(self):
+        n = int(self.headers.get("Content-Length", 0))
+        self.reply(self.rfile.read(n))
+
+
+class TCPServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 128
+
+
+class UnixServer(socketserver.ThreadingUnixStreamServer):
+    daemon_threads = True
+    request_queue_size = 128
+
+
+def main():
+    where = sys.argv[1] if len(sys.argv) > 1 else "8082"
+    if where.isdigit():
+        server = TCPServer(("127.0.0.1", int(where)), Handler)
+    else:
+        if os.path.exists(where):
+            os.unlink(where)
+        server = UnixServer(where, Handler)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+
+# Run scripts/bench.sh once per io_uring setup profile (sehttpd -p) and
+# print one line each: throughput, latency percentiles from bench/loadgen,
+# io_uring_enter() calls per response and SQEs per call from sehttpd-stat.
+#   BENCH_PROFILES  profiles to compare (default: default coop defer sqpoll)
+#   BENCH_ARGS      options for bench/loadgen, as for scripts/bench.sh
+#   BENCH_SERVER    further options for sehttpd
+
+profiles=${BENCH_PROFILES:-"default coop defer sqpoll"}
+server_args=$BENCH_SERVER
+status=0
+
+# "key": value out of the loadgen JSON
+field() {
+    echo "$1" | grep -o "\"$2\": [0-9.]*" | head -1 | cut -d' ' -f2
+}
+
+printf "%-16s %10s %9s %9s %9s %10s %10s\n" \
+       profile req/s p50_us p99_us p99.9_us enter/rsp sqe/enter
+for p in $profiles; do
+    result=$(BENCH_SERVER="$server_args -p $p" BENCH_BASELINE= BENCH_OUT= \
+             scripts/bench.sh) || status=1
+    # the server is gone, but its counters stay in shared memory
+    enters=$(./sehttpd-stat 2>/dev/null |
+             awk '$1 == "all" { print $(NF - 1), $NF }')
+    printf "%-16s %10s %9s %9s %9s %10s %10s\n" "$p" \
+           "$(field "$result" throughput_rps)" "$(field "$result" p50)" \
+           "$(field "$result" p99)" "$(field "$result" p99.9)" \
+           ${enters:-- -}
+done
+exit $status
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+
+# Start the server, load it with bench/loadgen and print the JSON result.
+#   BENCH_ARGS      options for bench/loadgen (default: closed loop, 64
+#                   keep-alive connections, 10 seconds)
+#   BENCH_SERVER    options for sehttpd
+#   BENCH_BASELINE  earlier result to compare with
+#   BENCH_OUT       file to keep this result in, e.g. as the next baseline
+
+LOCAL_PORT="8081"
+
+wait_server() {
+    local port
+    port=$1
+    for i in {1..20}; do
+        # sleep first because this maybe called immediately after server start
+        sleep 0.1
+        nc -z -w 4 127.0.0.1 $port && break
+    done
+}
+
+pkill -9 sehttpd >/dev/null 2>/dev/null
+
+./sehttpd $BENCH_SERVER >/dev/null &
+server_pid=$!
+wait_server $LOCAL_PORT
+
+result=$(bench/loadgen -p $LOCAL_PORT $BENCH_ARGS \
+         ${BENCH_BASELINE:+-b "$BENCH_BASELINE"})
+status=$?
+kill $server_pid
+wait $server_pid 2>/dev/null
+
+echo "$result"
+[ -n "$BENCH_OUT" ] && echo "$result" > "$BENCH_OUT"
+exit $status
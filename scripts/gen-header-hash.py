@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Generate src/http_header_hash.h, a perfect hash over the request headers
+the server understands.
+
+    hash(key) = (len + asso[key[0] | 0x20] + asso[key[len - 1] | 0x20]) & MASK
+
+ORing in 0x20 folds ASCII letters to lower case, so lookups are
+case-insensitive without a conversion pass. Add a name to HEADERS and run
+"make gen-headers" to regenerate.
+"""
+
+import random
+import sys
+
+HEADERS = [
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Expect",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Range",
+    "Referer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+]
+
+TABLE_SIZE = 64
+
+
+def enum_name(header):
+    return "HTTP_HDR_" + header.upper().replace("-", "_")
+
+
+def fold(c):
+    return ord(c) | 0x20
+
+
+def slot(header, asso):
+    return (len(header) + asso[fold(header[0])] +
+            asso[fold(header[-1])]) & (TABLE_SIZE - 1)
+
+
+def search():
+    rng = random.Random(1)
+    chars = sorted({fold(h[0]) for h in HEADERS} |
+                   {fold(h[-1]) for h in HEADERS})
+    for _ in range(1000000):
+        asso = [0] * 256
+        for c in chars:
+            asso[c] = rng.randrange(TABLE_SIZE)
+        if len({slot(h, asso) for h in HEADERS}) == len(HEADERS):
+            return asso
+    sys.exit("no perfect hash found, grow TABLE_SIZE")
+
+
+def main():
+    asso = search()
+    table = [None] * TABLE_SIZE
+    for h in HEADERS:
+        table[slot(h, asso)] = h
+
+    out = []
+    out.append("/* Generated by scripts/gen-header-hash.py, do not edit. */")
+    out.append("#ifndef HTTP_HEADER_HASH_H")
+    out.append("#define HTTP_HEADER_HASH_H")
+    out.append("")
+    out.append("#include <stddef.h>")
+    out.append("#include <stdint.h>")
+    out.append("#include <strings.h>")
+    out.append("")
+    out.append("enum http_header_id {")
+    out.append("    HTTP_HDR_UNKNOWN = 0,")
+    for h in HEADERS:
+        out.append("    %s," % enum_name(h))
+    out.append("    HTTP_HDR_COUNT")
+    out.append("};")
+    out.append("")
+    out.append("#define HTTP_HDR_MIN_LEN %d" % min(map(len, HEADERS)))
+    out.append("#define HTTP_HDR_MAX_LEN %d" % max(map(len, HEADERS)))
+    out.append("")
+    out.append("static const uint8_t http_header_asso[256] = {")
+    nonzero = ["[%d] = %d" % (c, v) for c, v in enumerate(asso) if v]
+    line = "   "
+    for item in nonzero:
+        if len(line) + len(item) + 2 > 80:
+            out.append(line)
+            line = "   "
+        line += " " + item + ","
+    out.append(line)
+    out.append("};")
+    out.append("")
+    out.append("static const struct {")
+    out.append("    const char *name;")
+    out.append("    uint8_t len, id;")
+    out.append("} http_header_slots[%d] = {" % TABLE_SIZE)
+    for i, h in enumerate(table):
+        if h:
+            out.append('    [%d] = {"%s", %d, %s},' %
+                       (i, h, len(h), enum_name(h)))
+    out.append("};")
+    out.append("")
+    out.append("/* One hash, one length check and at most one compare. */")
+    out.append("static inline enum http_header_id http_header_lookup("
+               "const char *key,")
+    out.append("                                                     "
+               "size_t len)")
+    out.append("{")
+    out.append("    if (len < HTTP_HDR_MIN_LEN || len > HTTP_HDR_MAX_LEN)")
+    out.append("        return HTTP_HDR_UNKNOWN;")
+    out.append("")
+    out.append("    unsigned h = (len + "
+               "http_header_asso[(uint8_t) key[0] | 0x20] +")
+    out.append("                  http_header_asso[(uint8_t) key[len - 1] "
+               "| 0x20]) &")
+    out.append("                 %d;" % (TABLE_SIZE - 1))
+    out.append("    if (http_header_slots[h].len != len ||")
+    out.append("        strncasecmp(http_header_slots[h].name, key, len))")
+    out.append("        return HTTP_HDR_UNKNOWN;")
+    out.append("    return http_header_slots[h].id;")
+    out.append("}")
+    out.append("")
+    out.append("#endif")
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
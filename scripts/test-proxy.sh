@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+
+# Forward requests to scripts/backend.py, over TCP and a unix socket, and
+# check what comes back: the three kinds of body framing, both relay paths,
+# request bodies, connection reuse and what happens once the upstream dies.
+
+LOCAL_PORT="8081"
+BACKEND_PORT="8082"
+BACKEND_SOCK=$(mktemp -u /tmp/sehttpd-backend.XXXXXX)
+url=http://127.0.0.1:$LOCAL_PORT
+failed=0
+
+wait_port() {
+    for i in {1..20}; do
+        sleep 0.1
+        curl -s -o /dev/null 127.0.0.1:$1 && break
+    done
+}
+
+check() {
+    local what expected got
+    what=$1
+    expected=$2
+    got=$3
+    if [ "$expected" = "$got" ]; then
+        echo "ok   $what"
+    else
+        echo "FAIL $what: expected '$expected', got '$got'"
+        failed=1
+    fi
+}
+
+# the bytes /len/N and friends send
+pattern() {
+    python3 -c "import sys; sys.stdout.write(('0123456789abcdef' * ($1 // 16 + 1))[:$1])"
+}
+
+status() {
+    curl -s -o /dev/null -w '%{http_code}' "$@"
+}
+
+pkill -9 sehttpd >/dev/null 2>/dev/null
+
+scripts/backend.py $BACKEND_PORT &
+backend_pid=$!
+scripts/backend.py "$BACKEND_SOCK" &
+unix_backend_pid=$!
+./sehttpd -t 1 -P /api=127.0.0.1:$BACKEND_PORT -P /sock=unix:"$BACKEND_SOCK" &
+server_pid=$!
+trap 'kill $server_pid $backend_pid $unix_backend_pid 2>/dev/null;
+      rm -f "$BACKEND_SOCK"' EXIT
+wait_port $BACKEND_PORT
+wait_port $LOCAL_PORT
+while [ ! -S "$BACKEND_SOCK" ]; do sleep 0.1; done
+
+for mode in len chunked close; do
+    for n in 10 100000 1048576; do
+        check "$mode $n" "$(pattern $n | md5sum)" \
+              "$(curl -s $url/api/$mode/$n | md5sum)"
+    done
+done
+check "unix socket" "$(pattern 1000 | md5sum)" \
+      "$(curl -s $url/sock/len/1000 | md5sum)"
+check "path kept" "X-Path: /api/len/1" \
+      "$(curl -s -D - -o /dev/null $url/api/len/1 | grep -o 'X-Path: [^[:space:]]*')"
+check "HEAD" "0" "$(curl -s -I -w '%{size_download}' -o /dev/null $url/api/len/100)"
+check "static next to it" "200" "$(status $url/)"
+
+# kept-alive on both sides: one client connection, one upstream connection
+check "reuse" "1" \
+      "$(curl -s $url/api/conn $url/api/conn $url/api/conn | sort -u | wc -l)"
+check "mixed on one connection" "200 200 200 200 " \
+      "$(curl -s -o /dev/null -o /dev/null -o /dev/null -o /dev/null \
+              -w '%{http_code} ' $url/api/len/10 $url/index.html \
+              $url/api/chunked/3000 $url/api/len/200000)"
+
+head -c 5000 /dev/urandom > /tmp/sehttpd-post.$$
+check "POST" "$(md5sum < /tmp/sehttpd-post.$$)" \
+      "$(curl -s --data-binary @/tmp/sehttpd-post.$$ $url/api/echo | md5sum)"
+head -c 20000 /dev/urandom > /tmp/sehttpd-post.$$
+check "body too large" "413" \
+      "$(status --data-binary @/tmp/sehttpd-post.$$ $url/api/echo)"
+rm -f /tmp/sehttpd-post.$$
+check "chunked request" "411" \
+      "$(status -H 'Transfer-Encoding: chunked' --data-binary x $url/api/echo)"
+
+kill $backend_pid
+wait $backend_pid 2>/dev/null
+check "upstream gone" "502 502 502" \
+      "$(status $url/api/x) $(status $url/api/x) $(status $url/api/x)"
+check "upstream down" "503" "$(status $url/api/x)"
+check "other route up" "200" "$(status $url/sock/x)"
+
+exit $failed
@@ -16,12 +16,15 @@ wait_server() {
 }
 
 start_http_server() {
-    ./sehttpd &	
+    ./sehttpd "$@" &
     server_pid=$!
+    wait_server $LOCAL_PORT
 }
 
 stop_http_server() {
     kill $server_pid
+    # with SO_REUSEPORT a server still going down would take connections
+    wait $server_pid 2>/dev/null
 }
 
 test_server_local() {
@@ -35,9 +38,66 @@ test_server_local() {
     done
 }
 
+# Pipeline requests one segment at a time without reading anything until
+# they are all out: the responses, larger than the socket buffers, back up
+# and the requests queue behind them. Every one of them must be answered.
+test_pipeline() {
+    local n size out got bytes
+    n=12
+    size=$((8 * 1024 * 1024))
+    out=$(mktemp)
+    head -c $size /dev/zero > www/pipeline.bin
+    exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT
+    # a subshell, so that a server hanging up only ends the writing
+    (for i in $(seq 1 $n); do
+        close=
+        [ $i -eq $n ] && close="Connection: close\r\n"
+        printf "GET /pipeline.bin HTTP/1.1\r\nHost: localhost\r\n$close\r\n"
+        sleep 0.05
+    done) >&3 2>/dev/null
+    sleep 0.5
+    timeout 10 cat <&3 > $out
+    exec 3>&-
+    got=$(grep -a -o "HTTP/1.1 200 OK" $out | wc -l)
+    bytes=$(wc -c < $out)
+    if [ $got -ne $n ] || [ $bytes -lt $((n * size)) ]; then
+        echo "pipelining $*: $got of $n responses, $bytes bytes"
+        status=1
+    fi
+    rm -f www/pipeline.bin $out
+}
+
+# Send a header that only outgrows HTTP_MAX_HEADER over several receives,
+# with no blank line to end it: it must still be answered with a 431.
+test_oversized() {
+    local got line
+    line="X-Filler: $(head -c 2990 /dev/zero | tr '\0' a)\r\n"
+    exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT
+    (printf "GET / HTTP/1.1\r\nHost: localhost\r\n$line"
+     sleep 0.1
+     printf "$line"
+     sleep 0.1
+     printf "$line") >&3 2>/dev/null
+    got=$(timeout 2 head -c 12 <&3)
+    exec 3>&-
+    if [ "$got" != "HTTP/1.1 431" ]; then
+        echo "oversized header $*: got '$got'"
+        status=1
+    fi
+}
+
 pkill -9 sehttpd >/dev/null 2>/dev/null
+status=0
 
 start_http_server
 test_server_local
 stop_http_server
 printf "\n"
+
+for engine in oneshot multishot; do
+    start_http_server -e $engine
+    test_pipeline -e $engine
+    test_oversized -e $engine
+    stop_http_server
+done
+exit $status
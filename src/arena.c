@@ -0,0 +1,60 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define SPILL_BLOCK_LEN 4096
+
+/* per worker, like the arenas themselves */
+static __thread arena_stats_t stats;
+
+static size_t block_header()
+{
+    return (sizeof(arena_block_t) + ARENA_ALIGN - 1) &
+           ~(size_t) (ARENA_ALIGN - 1);
+}
+
+/* Whatever is left of the current block is abandoned; requests that get
+ * here are rare enough for that not to matter.
+ */
+void *arena_alloc_slow(arena_t *a, size_t size)
+{
+    size_t len = size > SPILL_BLOCK_LEN ? size : SPILL_BLOCK_LEN;
+    arena_block_t *b = malloc(block_header() + len);
+    if (!b)
+        return NULL;
+
+    if (a->spill)
+        a->spilled += a->spill->len;
+    else
+        a->spilled += ARENA_INLINE_LEN;
+    b->len = len;
+    b->next = a->spill;
+    a->spill = b;
+    stats.spills++;
+
+    char *p = (char *) b + block_header();
+    a->cur = p + size;
+    a->end = p + len;
+    return p;
+}
+
+void arena_reset(arena_t *a)
+{
+    size_t cur_len = a->spill ? a->spill->len : ARENA_INLINE_LEN;
+    size_t used = a->spilled + cur_len - (a->end - a->cur);
+    if (used > stats.high_water)
+        stats.high_water = used;
+    stats.resets++;
+
+    while (a->spill) {
+        arena_block_t *b = a->spill;
+        a->spill = b->next;
+        free(b);
+    }
+    arena_init(a);
+}
+
+void arena_get_stats(arena_stats_t *s)
+{
+    *s = stats;
+}
@@ -0,0 +1,63 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_INLINE_LEN 1024 /* fits the headers of a typical browser */
+#define ARENA_ALIGN 16
+
+/* Bump allocator for everything that lives as long as one request. The
+ * first ARENA_INLINE_LEN bytes are part of the object embedding the arena;
+ * beyond that it spills into blocks from malloc(), which are only given
+ * back when the arena is reset.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t len;
+} arena_block_t;
+
+typedef struct {
+    char *cur, *end;
+    arena_block_t *spill; /* most recent first */
+    size_t spilled;       /* bytes in blocks that are full */
+    char inline_buf[ARENA_INLINE_LEN] __attribute__((aligned(ARENA_ALIGN)));
+} arena_t;
+
+typedef struct {
+    size_t high_water; /* most bytes any one request needed */
+    uint64_t resets, spills;
+} arena_stats_t;
+
+void *arena_alloc_slow(arena_t *a, size_t size);
+void arena_reset(arena_t *a);
+void arena_get_stats(arena_stats_t *stats);
+
+static inline void arena_init(arena_t *a)
+{
+    a->cur = a->inline_buf;
+    a->end = a->inline_buf + ARENA_INLINE_LEN;
+    a->spill = NULL;
+    a->spilled = 0;
+}
+
+static inline void *arena_alloc(arena_t *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if ((size_t) (a->end - a->cur) < size)
+        return arena_alloc_slow(a, size);
+
+    void *p = a->cur;
+    a->cur += size;
+    return p;
+}
+
+/* Give back the unused tail of @p, which must be the latest allocation. */
+static inline void arena_trim(arena_t *a, void *p, size_t used)
+{
+    used = (used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if ((char *) p + used <= a->cur)
+        a->cur = (char *) p + used;
+}
+
+#endif
@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "http.h"
+#include "logger.h"
+
+#define HASH_BUCKETS 1024 /* power of two */
+#define MAX_WATCHES 64
+#define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define WATCH_MASK                                                    \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int wd;
+    char dir[FILE_CACHE_PATH_LEN];
+} watch_t;
+
+/* Every worker has its own cache and its own inotify instance, so there is
+ * no locking anywhere in this file.
+ */
+static __thread file_entry_t *buckets[HASH_BUCKETS];
+static __thread struct list_head lru; /* most recently used first */
+static __thread struct list_head content_lru;
+static __thread file_cache_stats_t stats;
+
+static __thread int inotify_fd = -1;
+static __thread watch_t watches[MAX_WATCHES];
+static __thread int nr_watches;
+static __thread size_t webroot_len;
+static __thread char *event_buf;
+
+static uint32_t hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int add_watch(const char *dir)
+{
+    for (int i = 0; i < nr_watches; i++) {
+        if (!strcmp(watches[i].dir, dir))
+            return 0;
+    }
+    if (nr_watches == MAX_WATCHES || inotify_fd < 0)
+        return -1;
+
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd < 0)
+        return -1;
+
+    watches[nr_watches].wd = wd;
+    strcpy(watches[nr_watches].dir, dir);
+    nr_watches++;
+    return 0;
+}
+
+/* Watch the directories from the one holding @path up to the webroot: a
+ * directory that is moved is only reported to itself and to its parent,
+ * nothing tells the directories below it. Without the watches nothing
+ * would tell us the entry went stale, so the caller must not cache it.
+ */
+static int watch_parent(const char *path)
+{
+    char dir[FILE_CACHE_PATH_LEN];
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        return -1;
+
+    size_t len = slash - path;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    for (;;) {
+        if (add_watch(dir) < 0)
+            return -1;
+        char *up = strrchr(dir, '/');
+        if (len <= webroot_len || !up)
+            return 0;
+        *up = '\0';
+        len = up - dir;
+    }
+}
+
+int file_cache_init(const char *webroot,
+                    unsigned capacity,
+                    size_t content_budget,
+                    size_t content_max_file)
+{
+    INIT_LIST_HEAD(&lru);
+    INIT_LIST_HEAD(&content_lru);
+    stats.capacity = capacity ? capacity : FILE_CACHE_DEFAULT_ENTRIES;
+    stats.content_budget = content_budget;
+    stats.content_max_file = content_max_file;
+
+    /* Blocking on purpose: reads are issued through io_uring, which would
+     * hand -EAGAIN straight back for a non-blocking descriptor.
+     */
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_err("inotify_init1");
+        return -1;
+    }
+    event_buf = malloc(EVENT_BUF_LEN);
+    if (!event_buf)
+        return -1;
+
+    webroot_len = strlen(webroot);
+    if (add_watch(webroot) < 0) {
+        log_err("inotify_add_watch %s", webroot);
+        return -1;
+    }
+    return 0;
+}
+
+static void unlink_entry(file_entry_t *e)
+{
+    file_entry_t **pp = &buckets[e->hash & (HASH_BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    list_del(&e->lru);
+    if (e->content)
+        list_del(&e->content_lru);
+    e->cached = false;
+    stats.entries--;
+}
+
+static void free_content(file_entry_t *e)
+{
+    stats.content_bytes -= e->content_len;
+    free(e->content);
+    e->content = NULL;
+    e->content_len = 0;
+}
+
+static void destroy_entry(file_entry_t *e)
+{
+    if (e->content)
+        free_content(e);
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e);
+}
+
+/* Drop an entry from the index. Connections still sending from it keep the
+ * descriptor alive until their last file_cache_put().
+ */
+static void drop_entry(file_entry_t *e)
+{
+    unlink_entry(e);
+    if (e->refcnt == 0)
+        destroy_entry(e);
+}
+
+static bool evict_one()
+{
+    struct list_head *pos = lru.prev;
+    while (pos != &lru) {
+        file_entry_t *e = list_entry(pos, file_entry_t, lru);
+        pos = pos->prev;
+        if (e->refcnt == 0) {
+            drop_entry(e);
+            stats.evictions++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fill_entry(file_entry_t *e)
+{
+    struct stat sbuf;
+
+    e->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (e->fd < 0) {
+        e->status = (errno == EACCES) ? HTTP_FORBIDDEN : HTTP_NOT_FOUND;
+        return;
+    }
+
+    if (fstat(e->fd, &sbuf) < 0 || !(S_ISREG(sbuf.st_mode)) ||
+        !(S_IRUSR & sbuf.st_mode)) {
+        close(e->fd);
+        e->fd = -1;
+        e->status = HTTP_FORBIDDEN;
+        return;
+    }
+
+    e->status = 0;
+    e->size = sbuf.st_size;
+    e->mtime = sbuf.st_mtime;
+    e->mtime_nsec = sbuf.st_mtim.tv_nsec;
+    e->ino = sbuf.st_ino;
+}
+
+file_entry_t *file_cache_lookup(const char *path, int encoding)
+{
+    uint32_t hash = hash_path(path) ^ encoding;
+    file_entry_t *e;
+
+    stats.lookups++;
+    for (e = buckets[hash & (HASH_BUCKETS - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && e->encoding == encoding &&
+            !strcmp(e->path, path)) {
+            stats.hits++;
+            list_del(&e->lru);
+            list_add(&e->lru, &lru);
+            if (e->content) {
+                list_del(&e->content_lru);
+                list_add(&e->content_lru, &content_lru);
+            }
+            e->refcnt++;
+            return e;
+        }
+    }
+
+    size_t len = strlen(path);
+    if (len >= FILE_CACHE_PATH_LEN)
+        return NULL;
+
+    e = calloc(1, sizeof(file_entry_t));
+    if (!e)
+        return NULL;
+    memcpy(e->path, path, len + 1);
+    e->encoding = encoding;
+    e->hash = hash;
+    e->refcnt = 1;
+    fill_entry(e);
+
+    if (watch_parent(path) < 0)
+        return e; /* served once, then freed by file_cache_put() */
+
+    if (stats.entries >= stats.capacity && !evict_one())
+        return e;
+
+    e->cached = true;
+    e->hnext = buckets[hash & (HASH_BUCKETS - 1)];
+    buckets[hash & (HASH_BUCKETS - 1)] = e;
+    list_add(&e->lru, &lru);
+    stats.entries++;
+    return e;
+}
+
+void file_cache_put(file_entry_t *e)
+{
+    if (--e->refcnt == 0 && !e->cached)
+        destroy_entry(e);
+}
+
+/* Make room for @len more bytes of content. Eviction walks the content LRU
+ * from the cold end and frees by bytes, so one large response can push out
+ * several small ones but never the other way round without need. Content
+ * that is being sent right now is skipped.
+ */
+static bool make_room(file_entry_t *self, size_t len)
+{
+    struct list_head *pos = content_lru.prev;
+
+    while (stats.content_bytes + len > stats.content_budget) {
+        if (pos == &content_lru)
+            return false;
+        file_entry_t *e = list_entry(pos, file_entry_t, content_lru);
+        pos = pos->prev;
+        if (e != self && e->refcnt == 0) {
+            file_cache_drop_content(e);
+            stats.content_evictions++;
+        }
+    }
+    return true;
+}
+
+/* Hand out a buffer of @len bytes to hold the complete response for @e.
+ * Returns NULL when the file is over the size threshold, the entry is not
+ * indexed (nothing would invalidate the copy) or the budget cannot fit it.
+ */
+char *file_cache_reserve_content(file_entry_t *e, size_t len)
+{
+    if (!e->cached || e->content || e->size > stats.content_max_file ||
+        len > stats.content_budget)
+        return NULL;
+
+    if (!make_room(e, len))
+        return NULL;
+
+    e->content = malloc(len);
+    if (!e->content)
+        return NULL;
+    e->content_len = len;
+    stats.content_bytes += len;
+    list_add(&e->content_lru, &content_lru);
+    return e->content;
+}
+
+/* Give back the end of a reservation that turned out too large. */
+void file_cache_shrink_content(file_entry_t *e, size_t len)
+{
+    char *p = realloc(e->content, len);
+    if (p)
+        e->content = p;
+    stats.content_bytes -= e->content_len - len;
+    e->content_len = len;
+}
+
+void file_cache_drop_content(file_entry_t *e)
+{
+    if (!e->content)
+        return;
+    if (e->cached)
+        list_del(&e->content_lru);
+    free_content(e);
+}
+
+/* Invalidate @path and, when it names a directory, everything below it. */
+static void invalidate(const char *path)
+{
+    size_t len = strlen(path);
+    struct list_head *pos = lru.next;
+
+    while (pos != &lru) {
+        file_entry_t *e = list_entry(pos, file_entry_t, lru);
+        pos = pos->next;
+        if (!len || (!strncmp(e->path, path, len) &&
+                     (e->path[len] == '\0' || e->path[len] == '/'))) {
+            drop_entry(e);
+            stats.invalidations++;
+        }
+    }
+}
+
+static const char *watch_dir(int wd)
+{
+    for (int i = 0; i < nr_watches; i++) {
+        if (watches[i].wd == wd)
+            return watches[i].dir;
+    }
+    return NULL;
+}
+
+static void forget_watch(int wd)
+{
+    for (int i = 0; i < nr_watches; i++) {
+        if (watches[i].wd == wd) {
+            watches[i] = watches[--nr_watches];
+            return;
+        }
+    }
+}
+
+/* @dir was moved away: its watch and those below it follow it to where it
+ * went, under names that no longer match. Drop them, so that whatever is
+ * looked up there next is watched afresh.
+ */
+static void forget_watches_under(const char *moved)
+{
+    char dir[FILE_CACHE_PATH_LEN]; /* @moved may be one of the watches */
+    size_t len = strlen(moved);
+    memcpy(dir, moved, len + 1);
+
+    for (int i = 0; i < nr_watches;) {
+        const char *d = watches[i].dir;
+        if (!strncmp(d, dir, len) && (d[len] == '\0' || d[len] == '/')) {
+            inotify_rm_watch(inotify_fd, watches[i].wd);
+            watches[i] = watches[--nr_watches];
+        } else {
+            i++;
+        }
+    }
+}
+
+int file_cache_inotify_fd()
+{
+    return inotify_fd;
+}
+
+void *file_cache_event_buf(size_t *len)
+{
+    *len = EVENT_BUF_LEN;
+    return event_buf;
+}
+
+void file_cache_handle_events(int len)
+{
+    char path[FILE_CACHE_PATH_LEN];
+
+    for (char *p = event_buf; p < event_buf + len;) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        const char *dir = watch_dir(ev->wd);
+        if (!dir && (ev->mask & IN_IGNORED))
+            continue; /* from forget_watches_under() */
+        if ((ev->mask & IN_Q_OVERFLOW) || !dir) {
+            invalidate(""); /* lost track, start over */
+            continue;
+        }
+
+        const char *what = dir;
+        if (ev->len > 0 &&
+            snprintf(path, sizeof(path), "%s/%s", dir, ev->name) <
+                (int) sizeof(path))
+            what = path;
+        invalidate(what);
+
+        if (ev->mask & IN_IGNORED)
+            forget_watch(ev->wd);
+        else if ((ev->mask & IN_MOVE_SELF) ||
+                 (ev->mask & (IN_MOVED_FROM | IN_ISDIR)) ==
+                     (IN_MOVED_FROM | IN_ISDIR))
+            forget_watches_under(what);
+    }
+}
+
+void file_cache_get_stats(file_cache_stats_t *s)
+{
+    *s = stats;
+}
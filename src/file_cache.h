@@ -0,0 +1,77 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+
+#define FILE_CACHE_PATH_LEN 512
+#define FILE_CACHE_DEFAULT_ENTRIES 256
+#define FILE_CACHE_HEADER_LEN 384
+#define FILE_CACHE_DEFAULT_BUDGET (16 << 20)
+#define FILE_CACHE_DEFAULT_MAX_FILE (64 << 10)
+
+/* One resolved path under the webroot. Positive entries keep the file open
+ * so a hit costs no syscall at all; negative entries remember the 403/404
+ * verdict. Entries are owned by the worker that created them.
+ *
+ * An encoded variant of a file is an entry of its own, keyed by path and
+ * content coding: either a precompressed sibling ("a.html.gz") or the file
+ * itself with the compressed response in content.
+ */
+typedef struct file_entry {
+    char path[FILE_CACHE_PATH_LEN];
+    int encoding; /* enum http_encoding of the response body */
+    uint32_t hash;
+    int status; /* 0 when servable, else HTTP_NOT_FOUND or HTTP_FORBIDDEN */
+    int fd;
+    size_t size;
+    time_t mtime;
+    long mtime_nsec;
+    uint64_t ino;
+    /* pre-rendered response headers, filled in lazily by the HTTP layer */
+    const char *mime;
+    bool compressible; /* worth sending compressed, by MIME type */
+    char etag[64];     /* quoted, also part of header */
+    size_t etag_len;
+    char header[FILE_CACHE_HEADER_LEN];
+    size_t header_len, header_validators;
+
+    /* complete response (header followed by the body) for small files */
+    char *content;
+    size_t content_len;
+    struct list_head content_lru;
+
+    int refcnt; /* the cache itself does not hold a reference */
+    bool cached; /* false once evicted or invalidated */
+    struct file_entry *hnext;
+    struct list_head lru;
+} file_entry_t;
+
+typedef struct {
+    uint64_t lookups, hits;
+    uint64_t evictions, invalidations;
+    unsigned entries, capacity;
+    uint64_t content_evictions;
+    size_t content_bytes, content_budget, content_max_file;
+} file_cache_stats_t;
+
+int file_cache_init(const char *webroot,
+                    unsigned capacity,
+                    size_t content_budget,
+                    size_t content_max_file);
+file_entry_t *file_cache_lookup(const char *path, int encoding);
+void file_cache_put(file_entry_t *e);
+char *file_cache_reserve_content(file_entry_t *e, size_t len);
+void file_cache_shrink_content(file_entry_t *e, size_t len);
+void file_cache_drop_content(file_entry_t *e);
+
+int file_cache_inotify_fd();
+void *file_cache_event_buf(size_t *len);
+void file_cache_handle_events(int len);
+void file_cache_get_stats(file_cache_stats_t *stats);
+
+#endif
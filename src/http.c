@@ -1,41 +1,65 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "file_cache.h"
 #include "http.h"
+#include "http_scan.h"
 #include "logger.h"
+#include "metrics.h"
+#include "probes.h"
+#include "proxy.h"
 #include "uring.h"
 
-#define MAXLINE 8192
 #define SHORTLINE 512
-#define TIMEOUT_DEFAULT 1000
 
-static char *webroot = NULL;
+/* Files no larger than this are not worth compressing on the fly. */
+#define COMPRESS_MIN_SIZE 256
 
 typedef struct {
     const char *type;
     const char *value;
+    bool compressible;
 } mime_type_t;
 
-static mime_type_t mime[] = {{".html", "text/html"},
-                             {".xml", "text/xml"},
-                             {".xhtml", "application/xhtml+xml"},
-                             {".txt", "text/plain"},
-                             {".pdf", "application/pdf"},
-                             {".png", "image/png"},
-                             {".gif", "image/gif"},
-                             {".jpg", "image/jpeg"},
-                             {".css", "text/css"},
-                             {NULL, "text/plain"}};
+static mime_type_t mime[] = {{".html", "text/html", true},
+                             {".xml", "text/xml", true},
+                             {".xhtml", "application/xhtml+xml", true},
+                             {".txt", "text/plain", true},
+                             {".pdf", "application/pdf", false},
+                             {".png", "image/png", false},
+                             {".gif", "image/gif", false},
+                             {".jpg", "image/jpeg", false},
+                             {".css", "text/css", true},
+                             {".js", "text/javascript", true},
+                             {".svg", "image/svg+xml", true},
+                             {NULL, "text/plain", false}};
 
-static void parse_uri(char *uri, int uri_length, char *filename)
+/* by enum http_encoding; suffix names the precompressed sibling */
+static const struct {
+    const char *name, *suffix;
+} encodings[HTTP_ENC_COUNT] = {
+    [HTTP_ENC_GZIP] = {"gzip", ".gz"},
+    [HTTP_ENC_BR] = {"br", ".br"},
+};
+
+/* Map @uri under @root to the file to serve; @uri is NUL-terminated in
+ * place.
+ */
+void http_parse_uri(const char *root,
+                    char *uri,
+                    int uri_length,
+                    char *filename)
 {
-    assert(uri && "parse_uri: uri is NULL");
+    assert(uri && "http_parse_uri: uri is NULL");
     uri[uri_length] = '\0';
 
     /* TODO: support query string, i.e.
@@ -58,7 +82,7 @@ static void parse_uri(char *uri, int uri_length, char *filename)
         return;
     }
 
-    strcpy(filename, webroot);
+    strcpy(filename, root);
     debug("before strncat, filename = %s, uri = %.*s, file_len = %d", filename,
           file_length, uri, file_length);
     strncat(filename, uri, file_length);
@@ -74,158 +98,928 @@ static void parse_uri(char *uri, int uri_length, char *filename)
     debug("served filename = %s", filename);
 }
 
-static void do_error(int fd,
-                     char *cause,
-                     char *errnum,
-                     char *shortmsg,
-                     char *longmsg,
-                     http_request_t *r)
+static const mime_type_t *get_file_type(const char *type)
 {
-    char header[MAXLINE], body[MAXLINE];
+    int i;
+    for (i = 0; type && mime[i].type; ++i) {
+        if (!strcmp(type, mime[i].type))
+            break;
+    }
+    return &mime[i];
+}
 
-    sprintf(body,
-            "<html><title>Server Error</title>"
-            "<body>\n%s: %s\n<p>%s: %s\n</p>"
-            "<hr><em>web server</em>\n</body></html>",
-            errnum, shortmsg, longmsg, cause);
+#define STR_AND_LEN(s) s, sizeof(s) - 1
 
-    sprintf(header,
-            "HTTP/1.1 %s %s\r\n"
-            "Server: seHTTPd\r\n"
-            "Content-type: text/html\r\n"
-            "Connection: close\r\n"
-            "Content-length: %d\r\n\r\n",
-            errnum, shortmsg, (int) strlen(body));
+typedef struct {
+    int status;
+    const char *line; /* status line */
+    size_t line_len;
+    const char *shortmsg, *longmsg;
+    char page[SHORTLINE]; /* headers after Date:, then the body */
+    size_t page_len;
+} status_t;
 
-    add_write_request(header, r);
-    add_write_request(body, r);
+static status_t statuses[] = {
+    {HTTP_OK, STR_AND_LEN("HTTP/1.1 200 OK\r\n"), NULL, NULL, "", 0},
+    {HTTP_PARTIAL_CONTENT, STR_AND_LEN("HTTP/1.1 206 Partial Content\r\n"),
+     NULL, NULL, "", 0},
+    {HTTP_NOT_MODIFIED, STR_AND_LEN("HTTP/1.1 304 Not Modified\r\n"), NULL,
+     NULL, "", 0},
+    {HTTP_BAD_REQUEST, STR_AND_LEN("HTTP/1.1 400 Bad Request\r\n"),
+     "Bad Request", "Can't parse the request", "", 0},
+    {HTTP_FORBIDDEN, STR_AND_LEN("HTTP/1.1 403 Forbidden\r\n"), "Forbidden",
+     "Can't read the file", "", 0},
+    {HTTP_NOT_FOUND, STR_AND_LEN("HTTP/1.1 404 Not Found\r\n"), "Not Found",
+     "Can't find the file", "", 0},
+    {HTTP_LENGTH_REQUIRED, STR_AND_LEN("HTTP/1.1 411 Length Required\r\n"),
+     "Length Required", "The request body needs a Content-Length", "", 0},
+    {HTTP_CONTENT_TOO_LARGE, STR_AND_LEN("HTTP/1.1 413 Content Too Large\r\n"),
+     "Content Too Large", "The request body is too long", "", 0},
+    {HTTP_RANGE_NOT_SATISFIABLE,
+     STR_AND_LEN("HTTP/1.1 416 Range Not Satisfiable\r\n"),
+     "Range Not Satisfiable", "The range is outside the file", "", 0},
+    {HTTP_HEADER_TOO_LARGE,
+     STR_AND_LEN("HTTP/1.1 431 Request Header Fields Too Large\r\n"),
+     "Request Header Fields Too Large", "The request header is too long", "",
+     0},
+    {HTTP_INTERNAL_ERROR,
+     STR_AND_LEN("HTTP/1.1 500 Internal Server Error\r\n"),
+     "Internal Server Error", "Can't send the file", "", 0},
+    {HTTP_BAD_GATEWAY, STR_AND_LEN("HTTP/1.1 502 Bad Gateway\r\n"),
+     "Bad Gateway", "The upstream server did not answer", "", 0},
+    {HTTP_SERVICE_UNAVAILABLE,
+     STR_AND_LEN("HTTP/1.1 503 Service Unavailable\r\n"),
+     "Service Unavailable", "The upstream server is down", "", 0},
+    {0, NULL, 0, NULL, NULL, "", 0}};
+
+/* advertises the keep-alive idle timeout, rendered by http_init() */
+static char keep_alive_lines[64];
+static size_t keep_alive_len;
+
+static status_t *get_status(int status_code)
+{
+    status_t *st;
+    for (st = statuses; st->status; st++) {
+        if (st->status == status_code)
+            break;
+    }
+    return st->status ? st : NULL;
 }
 
-static const char *get_file_type(const char *type)
+/* Set up what all workers share: the header scanner for this CPU and the
+ * pre-rendered error pages, which are only ever copied afterwards.
+ */
+void http_init()
 {
-    if (!type)
-        return "text/plain";
+    char body[SHORTLINE];
 
-    int i;
-    for (i = 0; mime[i].type; ++i) {
-        if (!strcmp(type, mime[i].type))
-            return mime[i].value;
+    http_scan_init(HTTP_SCAN_AUTO);
+
+    /* whole seconds, rounded down so that clients normally give up first */
+    unsigned idle = timer_get_timeout(TIMER_IDLE) / 1000;
+    keep_alive_len = snprintf(keep_alive_lines, sizeof(keep_alive_lines),
+                              "Connection: keep-alive\r\n"
+                              "Keep-Alive: timeout=%u\r\n",
+                              idle ? idle : 1);
+
+    for (status_t *st = statuses; st->status; st++) {
+        if (!st->shortmsg)
+            continue;
+
+        int body_len = snprintf(body, sizeof(body),
+                                "<html><title>Server Error</title>"
+                                "<body>\n%d: %s\n<p>%s\n</p>"
+                                "<hr><em>web server</em>\n</body></html>",
+                                st->status, st->shortmsg, st->longmsg);
+        st->page_len = snprintf(st->page, sizeof(st->page),
+                                "Server: seHTTPd\r\n"
+                                "Content-type: text/html\r\n"
+                                "Connection: close\r\n"
+                                "Content-length: %d\r\n\r\n%s",
+                                body_len, body);
     }
-    return mime[i].value;
 }
 
-static const char *get_msg_from_status(int status_code)
+/* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", refreshed by a ring timer */
+static __thread char date_line[48];
+static __thread size_t date_line_len;
+static __thread time_t date_now;
+
+/* The ring timer fires at the second boundary of CLOCK_REALTIME, which
+ * time(2) may not have reached yet: it reads a coarser clock. Read the
+ * timer's own and round, so that a tick a little early or late still
+ * lands on the second it was meant for.
+ */
+void http_clock_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec + (ts.tv_nsec >= 500000000);
+    if (now == date_now)
+        return;
+
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    date_line_len = strftime(date_line, sizeof(date_line),
+                             "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    date_now = now;
+}
+
+static inline char *append(char *dst, const char *src, size_t len)
+{
+    memcpy(dst, src, len);
+    return dst + len;
+}
+
+static char *append_status(char *dst, int status_code)
+{
+    status_t *st = get_status(status_code);
+    metrics_status(status_code);
+    dst = append(dst, st->line, st->line_len);
+    return append(dst, date_line, date_line_len);
+}
+
+/* Append @len bytes at @base to the batch of responses being built. */
+static inline void queue_iov(http_request_t *r, const void *base, size_t len)
+{
+    r->iov[r->iovcnt].iov_base = (void *) base;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+}
+
+/* Response headers are rendered straight into the arena, where they stay
+ * until the whole batch is out. Running out of memory ends the batch and,
+ * after it, the connection.
+ */
+static char *begin_header(http_request_t *r)
+{
+    char *hdr = arena_alloc(&r->arena, RESP_HEADER_LEN);
+    if (!hdr)
+        r->keep_alive = false;
+    return hdr;
+}
+
+static void end_header(http_request_t *r, char *hdr, char *end)
 {
-    if (status_code == HTTP_OK)
-        return "OK";
+    arena_trim(&r->arena, hdr, end - hdr);
+    queue_iov(r, hdr, end - hdr);
+}
 
-    if (status_code == HTTP_NOT_MODIFIED)
-        return "Not Modified";
+static void do_error(int status_code, http_request_t *r)
+{
+    char *hdr = begin_header(r);
+    if (!hdr)
+        return;
 
-    if (status_code == HTTP_NOT_FOUND)
-        return "Not Found";
+    char *p = append_status(hdr, status_code);
+    status_t *st = get_status(status_code);
+    p = append(p, st->page, st->page_len);
 
-    return "Unknown";
+    r->keep_alive = false;
+    end_header(r, hdr, p);
 }
 
-static void serve_static(int fd,
-                         char *filename,
-                         size_t filesize,
+/* An error in place of a proxied response, which is the only thing left
+ * in the batch by then.
+ */
+void http_send_error(http_request_t *r, int status_code)
+{
+    r->iovcnt = 0;
+    do_error(status_code, r);
+    add_send_request(r);
+}
+
+/* Everything in the header that only depends on the file is rendered once
+ * per file cache entry. Last-Modified starts at header_validators, which is
+ * where a 304 response picks up. An encoded variant takes its type and
+ * modification time from @origin, the file it stands for, and says how
+ * long its own body is, @len.
+ *
+ * The entity tag is the inode, size and modification time in nanoseconds
+ * of the file the body comes from, so any replacement of it changes the
+ * tag; variants carry their coding as well, as their bytes differ.
+ */
+static void render_file_header(file_entry_t *file,
+                               const file_entry_t *origin,
+                               size_t len)
+{
+    char modified[SHORTLINE];
+    struct tm tm;
+
+    if (file == origin) {
+        const mime_type_t *m = get_file_type(strrchr(file->path, '.'));
+        file->mime = m->value;
+        file->compressible = m->compressible;
+    } else {
+        file->mime = origin->mime;
+        file->compressible = origin->compressible;
+    }
+    gmtime_r(&origin->mtime, &tm);
+    strftime(modified, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    file->etag_len = snprintf(
+        file->etag, sizeof(file->etag), "\"%" PRIx64 "-%zx-%" PRIx64 "%s%s\"",
+        file->ino, file->size,
+        (uint64_t) file->mtime * 1000000000 + file->mtime_nsec,
+        file->encoding != HTTP_ENC_IDENTITY ? "-" : "",
+        file->encoding != HTTP_ENC_IDENTITY ? encodings[file->encoding].name
+                                            : "");
+
+    int n = snprintf(file->header, sizeof(file->header),
+                     "Content-type: %s\r\n"
+                     "Content-length: %zu\r\n",
+                     file->mime, len);
+    if (file->encoding != HTTP_ENC_IDENTITY)
+        n += snprintf(file->header + n, sizeof(file->header) - n,
+                      "Content-Encoding: %s\r\n",
+                      encodings[file->encoding].name);
+    file->header_validators = n;
+    n += snprintf(file->header + n, sizeof(file->header) - n,
+                  "Last-Modified: %s\r\n"
+                  "ETag: %s\r\n"
+                  "%s"
+                  "Server: seHTTPd\r\n\r\n",
+                  modified, file->etag,
+                  file->compressible ? "Vary: Accept-Encoding\r\n" : "");
+    file->header_len = n;
+}
+
+/* Keep the whole response for a small file in memory. This is the only
+ * read(2) the file ever sees; later hits are served from the copy until
+ * inotify invalidates the entry.
+ */
+static void load_content(file_entry_t *file)
+{
+    char *buf = file_cache_reserve_content(file, file->header_len + file->size);
+    if (!buf)
+        return;
+
+    memcpy(buf, file->header, file->header_len);
+    if (pread(file->fd, buf + file->header_len, file->size, 0) !=
+        (ssize_t) file->size)
+        file_cache_drop_content(file);
+}
+
+/* Compress @origin into the response kept in @v, its gzip variant. This
+ * happens once: later requests are served from the copy until the file
+ * changes or the copy is evicted. Data that does not shrink is marked, so
+ * it is not tried again either.
+ */
+static bool load_compressed(file_entry_t *v, const file_entry_t *origin)
+{
+    /* room for the header and the worst case, 18 bytes of gzip framing */
+    size_t bound = compressBound(origin->size) + 18;
+    char *buf = file_cache_reserve_content(v, FILE_CACHE_HEADER_LEN + bound);
+    if (!buf)
+        return false;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    char *src = malloc(origin->size);
+    /* 15 + 16: the largest window, wrapped as gzip */
+    if (!src || pread(v->fd, src, origin->size, 0) != (ssize_t) origin->size ||
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(src);
+        file_cache_drop_content(v);
+        return false;
+    }
+
+    char *body = buf + FILE_CACHE_HEADER_LEN;
+    zs.next_in = (unsigned char *) src;
+    zs.avail_in = origin->size;
+    zs.next_out = (unsigned char *) body;
+    zs.avail_out = bound;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+    free(src);
+
+    if (rc != Z_STREAM_END || len >= origin->size) {
+        file_cache_drop_content(v);
+        v->status = HTTP_NOT_FOUND; /* no such variant */
+        return false;
+    }
+
+    render_file_header(v, origin, len);
+    memmove(buf + v->header_len, body, len);
+    memcpy(buf, v->header, v->header_len);
+    file_cache_shrink_content(v, v->header_len + len);
+    return true;
+}
+
+/* Swap @file for the best variant the client accepts: a precompressed
+ * sibling on disk that is not older than the file, or else the file
+ * compressed into the content cache. Lookups of missing siblings hit
+ * negative cache entries, so a file without siblings costs no syscall.
+ */
+static file_entry_t *select_variant(file_entry_t *file,
+                                    char *filename,
+                                    const http_out_t *out)
+{
+    size_t len = strlen(filename);
+    file_entry_t *v;
+
+    for (int enc = HTTP_ENC_COUNT - 1; enc > HTTP_ENC_IDENTITY; enc--) {
+        if (!(out->encodings & (1u << enc)) ||
+            len + strlen(encodings[enc].suffix) >= SHORTLINE)
+            continue;
+        strcpy(filename + len, encodings[enc].suffix);
+        v = file_cache_lookup(filename, enc);
+        filename[len] = '\0';
+        if (!v)
+            continue;
+        if (!v->status && v->mtime >= file->mtime) {
+            if (!v->header_len)
+                render_file_header(v, file, v->size);
+            file_cache_put(file);
+            return v;
+        }
+        file_cache_put(v);
+    }
+
+    if (!(out->encodings & (1u << HTTP_ENC_GZIP)) ||
+        file->size < COMPRESS_MIN_SIZE)
+        return file;
+    v = file_cache_lookup(filename, HTTP_ENC_GZIP);
+    if (!v)
+        return file;
+    if (!v->status && (v->content || load_compressed(v, file))) {
+        file_cache_put(file);
+        return v;
+    }
+    file_cache_put(v);
+    return file;
+}
+
+/* The body follows the batch asynchronously, see add_splice_request(); the
+ * connection keeps the cache reference until the last byte is out.
+ */
+static bool start_body(http_request_t *r,
+                       file_entry_t *file,
+                       off_t off,
+                       size_t len)
+{
+    if (r->pipefd[0] < 0 && pipe(r->pipefd) < 0) {
+        log_err("pipe");
+        r->pipefd[0] = r->pipefd[1] = -1;
+        return false;
+    }
+    r->file = file;
+    r->file_off = off;
+    r->file_left = len;
+    r->pipe_len = 0;
+    return true;
+}
+
+char *http_append_connection(char *p, bool keep_alive)
+{
+    return keep_alive ? append(p, keep_alive_lines, keep_alive_len)
+                      : append(p, STR_AND_LEN("Connection: close\r\n"));
+}
+
+/* Parse the leading digits at *@p; returns -1 if there are none. */
+static long long parse_offset(const char **p, const char *end)
+{
+    long long v = -1;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        if (v > (LLONG_MAX - 9) / 10)
+            return -1;
+        v = (v < 0 ? 0 : v * 10) + (**p - '0');
+    }
+    return v;
+}
+
+/* Resolve "bytes=0-99, 200-, -50" against a file of @size bytes. Returns
+ * how many ranges are satisfiable, with their offsets and lengths in
+ * @parts, or -1 if the header is to be ignored: another unit, a syntax
+ * error or more than HTTP_MAX_RANGES ranges.
+ */
+static int parse_ranges(const char *p, int len, size_t size, http_part_t *parts)
+{
+    const char *end = p + len;
+    int n = 0, seen = 0;
+
+    if (len < 6 || strncasecmp(p, "bytes=", 6))
+        return -1;
+    for (p += 6; p < end;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+
+        long long first = parse_offset(&p, end), last = -1;
+        if (p == end || *p++ != '-')
+            return -1;
+        last = parse_offset(&p, end);
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if ((p < end && *p != ',') || (first < 0 && last < 0) ||
+            (first >= 0 && last >= 0 && last < first) ||
+            ++seen > HTTP_MAX_RANGES)
+            return -1;
+
+        if (first < 0) { /* the last @last bytes */
+            if (last == 0 || size == 0)
+                continue;
+            first = (size_t) last > size ? 0 : size - last;
+            last = size - 1;
+        } else if ((size_t) first >= size) {
+            continue;
+        } else if (last < 0 || (size_t) last >= size) {
+            last = size - 1;
+        }
+        parts[n].off = first;
+        parts[n].len = last - first + 1;
+        n++;
+    }
+    return seen ? n : -1;
+}
+
+static void do_range_error(http_request_t *r, size_t size)
+{
+    char *hdr = begin_header(r);
+    if (!hdr)
+        return;
+
+    char *p = append_status(hdr, HTTP_RANGE_NOT_SATISFIABLE);
+    p += snprintf(p, RESP_HEADER_LEN - (p - hdr),
+                  "Content-Range: bytes */%zu\r\n", size);
+    status_t *st = get_status(HTTP_RANGE_NOT_SATISFIABLE);
+    p = append(p, st->page, st->page_len);
+
+    r->keep_alive = false;
+    end_header(r, hdr, p);
+}
+
+/* Answer with the @n ranges in @parts. A single range is a slice of the
+ * cached copy or goes out of the file by splice like a whole body does;
+ * several make a multipart/byteranges body whose parts are spliced one
+ * after the other, see http_next_part(). The body is set up before the
+ * status is rendered, so that a failure there only counts the 500.
+ */
+static void serve_ranges(file_entry_t *file,
                          http_out_t *out,
-                         http_request_t *r)
+                         http_request_t *r,
+                         http_part_t *parts,
+                         int n)
 {
-    char header[MAXLINE];
+    static __thread unsigned long long boundary_seq;
+    char boundary[24];
+    http_part_t *all = NULL;
+    size_t total = 0;
 
-    const char *dot_pos = strrchr(filename, '.');
-    const char *file_type = get_file_type(dot_pos);
+    /* the part headers and the closing boundary are counted in
+     * Content-length, so all of them are rendered now, ahead of the header
+     * so that it stays the latest allocation in the arena
+     */
+    if (n > 1) {
+        snprintf(boundary, sizeof(boundary), "%016llx",
+                 (unsigned long long) date_now * 0x9e3779b97f4a7c15ULL +
+                     ++boundary_seq);
+        all = arena_alloc(&r->arena, (n + 1) * sizeof(*all));
+        for (int i = 0; all && i <= n; i++) {
+            all[i] = i < n ? parts[i] : (http_part_t){.off = 0, .len = 0};
+            all[i].hdr = arena_alloc(&r->arena, SHORTLINE);
+            if (!all[i].hdr) {
+                all = NULL;
+                break;
+            }
+            if (i < n)
+                all[i].hdr_len = snprintf(
+                    all[i].hdr, SHORTLINE,
+                    "\r\n--%s\r\n"
+                    "Content-type: %s\r\n"
+                    "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                    boundary, file->mime, (size_t) all[i].off,
+                    (size_t) all[i].off + all[i].len - 1, file->size);
+            else
+                all[i].hdr_len = snprintf(all[i].hdr, SHORTLINE,
+                                          "\r\n--%s--\r\n", boundary);
+            arena_trim(&r->arena, all[i].hdr, all[i].hdr_len);
+            total += all[i].hdr_len + all[i].len;
+        }
+        if (!all) {
+            do_error(HTTP_INTERNAL_ERROR, r);
+            file_cache_put(file);
+            return;
+        }
+    }
+
+    char *hdr = begin_header(r);
+    if (!hdr) {
+        file_cache_put(file);
+        return;
+    }
+    bool spliced = n > 1 || !file->content;
+    if (spliced && !start_body(r, file, parts[0].off, parts[0].len)) {
+        arena_trim(&r->arena, hdr, 0);
+        do_error(HTTP_INTERNAL_ERROR, r);
+        file_cache_put(file);
+        return;
+    }
 
-    sprintf(header, "HTTP/1.1 %d %s\r\n", out->status,
-            get_msg_from_status(out->status));
+    char *p = append_status(hdr, HTTP_PARTIAL_CONTENT);
+    p = http_append_connection(p, out->keep_alive);
+    if (n == 1)
+        p += snprintf(p, RESP_HEADER_LEN - (p - hdr),
+                      "Content-type: %s\r\n"
+                      "Content-Range: bytes %zu-%zu/%zu\r\n"
+                      "Content-length: %zu\r\n",
+                      file->mime, (size_t) parts[0].off,
+                      (size_t) parts[0].off + parts[0].len - 1, file->size,
+                      parts[0].len);
+    else
+        p += snprintf(p, RESP_HEADER_LEN - (p - hdr),
+                      "Content-type: multipart/byteranges; boundary=%s\r\n"
+                      "Content-length: %zu\r\n",
+                      boundary, total);
+    p = append(p, file->header + file->header_validators,
+               file->header_len - file->header_validators);
+    end_header(r, hdr, p);
 
-    if (out->keep_alive) {
-        sprintf(header, "%sConnection: keep-alive\r\n", header);
-        sprintf(header, "%sKeep-Alive: timeout=%d\r\n", header,
-                TIMEOUT_DEFAULT);
+    if (n > 1) {
+        queue_iov(r, all[0].hdr, all[0].hdr_len);
+        r->parts = all;
+        r->nr_parts = n + 1;
+        r->cur_part = 0;
+    } else if (!spliced) {
+        queue_iov(r, file->content + file->header_len + parts[0].off,
+                  parts[0].len);
+        r->held[r->nr_held++] = file;
     }
+}
+
+/* The body of the current part is out: queue the header of the next one
+ * and point the splice at its bytes. Returns false after the last part.
+ */
+bool http_next_part(http_request_t *r)
+{
+    if (r->cur_part + 1 >= r->nr_parts)
+        return false;
+
+    http_part_t *part = &r->parts[++r->cur_part];
+    r->iovcnt = 0;
+    queue_iov(r, part->hdr, part->hdr_len);
+    r->file_off = part->off;
+    r->file_left = part->len;
+    r->pipe_len = 0;
+    return true;
+}
+
+static void serve_static(file_entry_t *file,
+                         http_out_t *out,
+                         http_request_t *r)
+{
+    size_t filesize = file->size;
 
-    if (out->modified) {
-        char buf[SHORTLINE];
-        sprintf(header, "%sContent-type: %s\r\n", header, file_type);
-        sprintf(header, "%sContent-length: %zu\r\n", header, filesize);
-        struct tm tm;
-        localtime_r(&(out->mtime), &tm);
-        strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        sprintf(header, "%sLast-Modified: %s\r\n", header, buf);
+    if (out->modified && !file->content)
+        load_content(file);
+
+    if (out->range && !out->range_stale && out->status == HTTP_OK) {
+        http_part_t parts[HTTP_MAX_RANGES];
+        int n = parse_ranges(out->range, out->range_len, filesize, parts);
+        if (n == 0) {
+            do_range_error(r, filesize);
+            file_cache_put(file);
+            return;
+        }
+        if (n > 0) {
+            serve_ranges(file, out, r, parts, n);
+            return;
+        }
     }
 
-    sprintf(header, "%sServer: seHTTPd\r\n", header);
-    sprintf(header, "%s\r\n", header);
+    char *hdr = begin_header(r);
+    if (!hdr) {
+        file_cache_put(file);
+        return;
+    }
+    /* a body that cannot be spliced is a 500, counted instead */
+    if (out->modified && !file->content && filesize > 0 &&
+        !start_body(r, file, 0, filesize)) {
+        arena_trim(&r->arena, hdr, 0);
+        do_error(HTTP_INTERNAL_ERROR, r);
+        file_cache_put(file);
+        return;
+    }
 
-    add_write_request(header, r);
+    char *p = append_status(hdr, out->status);
+    p = http_append_connection(p, out->keep_alive);
 
-    if (!out->modified)
+    if (out->modified && file->content) {
+        /* header and the cached copy go out in the batch; the reference
+         * keeps the copy alive until it is sent
+         */
+        end_header(r, hdr, p);
+        queue_iov(r, file->content, file->content_len);
+        r->held[r->nr_held++] = file;
         return;
+    }
 
-    int srcfd = open(filename, O_RDONLY, 0);
-    assert(srcfd > 2 && "open error");
-    /* TODO: use sendfile(2) for zero-copy support */
-    int n = sendfile(fd, srcfd, 0, filesize);
-    assert(n == filesize && "sendfile");
-    close(srcfd);
+    if (out->modified)
+        p = append(p, file->header, file->header_len);
+    else
+        p = append(p, file->header + file->header_validators,
+                   file->header_len - file->header_validators);
+    end_header(r, hdr, p);
+
+    if (r->file != file)
+        file_cache_put(file);
 }
 
-static inline int init_http_out(http_out_t *o, int fd)
+static inline int init_http_out(http_out_t *o, http_request_t *r)
 {
-    o->fd = fd;
-    o->keep_alive = false;
+    o->fd = r->fd;
+    /* persistent by default from HTTP/1.1 on */
+    o->keep_alive = r->http_major > 1 ||
+                    (r->http_major == 1 && r->http_minor >= 1);
+    o->mtime = 0;
     o->modified = true;
     o->status = 0;
+    o->encodings = 0;
+    o->range = NULL;
+    o->range_len = 0;
+    o->range_stale = false;
+    o->etag = NULL;
+    o->etag_len = 0;
+    o->if_none_match = NULL;
+    o->if_none_match_len = 0;
     return 0;
 }
 
-void do_request(void *ptr, int n)
+enum { SERVE_QUEUED, SERVE_BLANK, SERVE_PARTIAL };
+
+/* Parse the request at r->pos, or carry on with the one that stopped
+ * there, and queue its response.
+ */
+static int serve_one(http_request_t *r)
 {
-    http_request_t *r = ptr;
-    int fd = r->fd;
-    int rc;
     char filename[SHORTLINE];
-    webroot = r->root;
+    int rc;
 
-    r->buf = get_bufs(r->bid);
-    r->pos = 0;
-    r->last = n;
+    if (r->phase == HTTP_PARSE_IDLE) {
+        r->req_off = r->pos;
+        r->state = 0;
+        r->request_end = NULL;
+        INIT_LIST_HEAD(&r->list);
+        r->phase = HTTP_PARSE_LINE;
+    }
 
-    rc = http_parse_request_line(r);
+    if (r->phase == HTTP_PARSE_LINE) {
+        rc = http_parse_request_line(r);
+        if (rc == EAGAIN && r->state == 0) {
+            /* nothing but blank lines */
+            r->pos = r->last;
+            r->phase = HTTP_PARSE_IDLE;
+            return SERVE_BLANK;
+        }
+        if (rc == EAGAIN)
+            return SERVE_PARTIAL;
+        if (rc != 0) {
+            r->phase = HTTP_PARSE_IDLE;
+            do_error(HTTP_BAD_REQUEST, r);
+            return SERVE_QUEUED;
+        }
+        r->phase = HTTP_PARSE_HEADERS;
+    }
 
-    debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
-          (char *) r->uri_start);
+    if (r->phase == HTTP_PARSE_HEADERS) {
+        rc = http_parse_request_body(r);
+        if (rc == EAGAIN)
+            return SERVE_PARTIAL;
+        r->phase = HTTP_PARSE_IDLE;
+        if (rc != 0) {
+            do_error(HTTP_BAD_REQUEST, r);
+            return SERVE_QUEUED;
+        }
+        if (r->pos - r->req_off > HTTP_MAX_HEADER) {
+            do_error(HTTP_HEADER_TOO_LARGE, r);
+            return SERVE_QUEUED;
+        }
 
-    rc = http_parse_request_body(r);
-    http_out_t *out = malloc(sizeof(http_out_t));
-    init_http_out(out, fd);
-    parse_uri(r->uri_start, r->uri_end - r->uri_start, filename);
+        debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
+              (char *) r->uri_start);
+        PROBE3(parsed, r, r->uri_start,
+               (char *) r->uri_end - (char *) r->uri_start);
 
-    struct stat sbuf;
-    if (stat(filename, &sbuf) < 0) {
-        do_error(fd, filename, "404", "Not Found", "Can't find the file", r);
-        return;
+        /* only a proxied request may have a body, it comes along */
+        r->body_len = 0;
+        r->route = proxy_route(r->uri_start,
+                               (char *) r->uri_end - (char *) r->uri_start);
+        if (r->route >= 0 && (rc = proxy_body_len(r)) != 0) {
+            if (rc < 0) {
+                do_error(-rc, r);
+                return SERVE_QUEUED;
+            }
+            r->body_len = rc;
+            r->phase = HTTP_PARSE_BODY;
+        }
     }
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-        do_error(fd, filename, "403", "Forbidden", "Can't read the file", r);
-        return;
+
+    if (r->phase == HTTP_PARSE_BODY) {
+        if (r->last - r->pos < r->body_len)
+            return SERVE_PARTIAL;
+        r->phase = HTTP_PARSE_IDLE;
+    }
+
+    http_out_t *out = arena_alloc(&r->arena, sizeof(http_out_t));
+    if (!out) {
+        do_error(HTTP_INTERNAL_ERROR, r);
+        return SERVE_QUEUED;
+    }
+    init_http_out(out, r);
+
+    if (r->route >= 0) {
+        rc = proxy_queue(r, out);
+        r->pos += r->body_len;
+        if (!out->keep_alive)
+            r->keep_alive = false;
+        if (rc)
+            do_error(rc, r);
+        return SERVE_QUEUED;
+    }
+
+    http_parse_uri(r->root, r->uri_start, r->uri_end - r->uri_start,
+                   filename);
+
+    file_entry_t *file = file_cache_lookup(filename, HTTP_ENC_IDENTITY);
+    PROBE3(resolved, r, filename, file ? file->status : HTTP_NOT_FOUND);
+    if (!file || file->status) {
+        do_error(file ? file->status : HTTP_NOT_FOUND, r);
+        if (file)
+            file_cache_put(file);
+        return SERVE_QUEUED;
     }
 
-    out->mtime = sbuf.st_mtime;
+    if (!file->header_len)
+        render_file_header(file, file, file->size);
+    out->mtime = file->mtime;
+    out->etag = file->etag;
+    out->etag_len = file->etag_len;
     http_handle_header(r, out);
 
     if (!out->status)
         out->status = HTTP_OK;
 
-    serve_static(fd, filename, sbuf.st_size, out, r);
-
     if (!out->keep_alive)
         r->keep_alive = false;
 
-    free(out);
-    return;
+    /* a range is a range of the file as it is on disk */
+    if (out->encodings && file->compressible && file->size > 0 &&
+        !out->range)
+        file = select_variant(file, filename, out);
+    /* If-None-Match wins over If-Modified-Since, and it is about the
+     * representation actually chosen
+     */
+    if (out->if_none_match) {
+        out->modified = !http_etag_listed(out->if_none_match,
+                                          out->if_none_match_len, file->etag,
+                                          file->etag_len);
+        out->status = out->modified ? HTTP_OK : HTTP_NOT_MODIFIED;
+    }
+
+    serve_static(file, out, r);
+    return SERVE_QUEUED;
+}
+
+/* a partial request and what comes next: a receive buffer, or at most
+ * HTTP_MAX_HEADER bytes from the spill, see on_read()
+ */
+#define INBUF_LEN (2 * HTTP_MAX_HEADER)
+
+static inline void rebase(void **ptr, char *from, size_t len, char *to)
+{
+    char *p = *ptr;
+    if (p >= from && p <= from + len)
+        *ptr = to + (p - from);
+}
+
+/* Move the unfinished request to the front of r->inbuf, where the rest of
+ * it is appended as it arrives. The parser keeps pointers into the bytes
+ * it has seen, those move along so that it resumes where it stopped.
+ */
+static int stash_partial(http_request_t *r)
+{
+    char *from = r->buf + r->req_off;
+    size_t len = r->last - r->req_off;
+
+    if (len > HTTP_MAX_HEADER)
+        return -1;
+    if (!r->inbuf && !(r->inbuf = malloc(INBUF_LEN)))
+        return -1;
+    if (from == r->inbuf)
+        return 0;
+
+    memmove(r->inbuf, from, len);
+    rebase(&r->request_start, from, len, r->inbuf);
+    rebase(&r->uri_start, from, len, r->inbuf);
+    rebase(&r->uri_end, from, len, r->inbuf);
+    rebase(&r->request_end, from, len, r->inbuf);
+    rebase(&r->cur_header_key_start, from, len, r->inbuf);
+    rebase(&r->cur_header_key_end, from, len, r->inbuf);
+    rebase(&r->cur_header_value_start, from, len, r->inbuf);
+    rebase(&r->cur_header_value_end, from, len, r->inbuf);
+
+    list_head *pos;
+    list_for_each (pos, &r->list) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        rebase(&hd->key_start, from, len, r->inbuf);
+        rebase(&hd->key_end, from, len, r->inbuf);
+        rebase(&hd->value_start, from, len, r->inbuf);
+        rebase(&hd->value_end, from, len, r->inbuf);
+    }
+
+    r->buf = r->inbuf;
+    r->pos -= r->req_off;
+    r->last = len;
+    r->req_off = 0;
+    return 0;
+}
+
+/* Answer every complete request from r->pos on with a single send. The
+ * batch stops early at a body that has to be spliced, which must follow
+ * its own header, at a proxied request, whose response comes later, and
+ * at a response that closes the connection; once it is out the caller
+ * comes back for the rest. A request that is not complete yet is set
+ * aside until more arrives. Returns 0 if nothing was queued.
+ */
+int http_serve(http_request_t *r)
+{
+    /* the previous batch is out, so is everything it allocated, except
+     * for the headers of a request still being received
+     */
+    if (!http_request_partial(r))
+        arena_reset(&r->arena);
+    r->iovcnt = 0;
+    r->nr_held = 0;
+
+    int served = 0;
+    while (r->keep_alive && !r->file && !r->upstream &&
+           served < HTTP_MAX_PIPELINE && http_input_pending(r)) {
+        int rc = serve_one(r);
+        if (rc == SERVE_QUEUED)
+            served++;
+        else if (rc == SERVE_PARTIAL)
+            break;
+    }
+
+    if (http_request_partial(r) && r->keep_alive && stash_partial(r) < 0) {
+        r->phase = HTTP_PARSE_IDLE;
+        r->pos = r->last;
+        do_error(HTTP_HEADER_TOO_LARGE, r);
+    }
+
+    /* a 431 on its own counts, or the caller would take it for nothing and
+     * release the request under the send
+     */
+    if (r->iovcnt && !served)
+        served = 1;
+
+    /* a proxied request first in the batch starts right away */
+    if (!r->iovcnt)
+        return proxy_continue(r) ? served : 0;
+    add_send_request(r);
+    return served;
+}
+
+/* Take in a freshly received buffer. */
+int do_request(void *ptr, int n)
+{
+    http_request_t *r = ptr;
+    return http_input(r, get_bufs(r->bid), n);
+}
+
+/* Take in @n bytes at @in, which stay put until the batch is out. Requests
+ * are parsed right where they were received, only a request that arrived
+ * in pieces is put together in r->inbuf.
+ */
+int http_input(http_request_t *r, char *in, int n)
+{
+    if (!http_request_partial(r)) {
+        free(r->inbuf);
+        r->inbuf = NULL;
+        r->buf = in;
+        r->pos = 0;
+        r->last = n;
+    } else {
+        /* fits: stash_partial() keeps at most HTTP_MAX_HEADER bytes */
+        memcpy(r->inbuf + r->last, in, n);
+        r->last += n;
+    }
+    return http_serve(r);
+}
+
+/* The batch is out: drop the references that pinned its bodies. */
+void http_response_done(http_request_t *r)
+{
+    for (int i = 0; i < r->nr_held; i++)
+        file_cache_put(r->held[i]);
+    r->nr_held = 0;
+    if (r->file) {
+        file_cache_put(r->file);
+        r->file = NULL;
+    }
+    r->parts = NULL;
+    r->nr_parts = r->cur_part = 0;
+    proxy_release(r);
 }
@@ -3,9 +3,15 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "list.h"
+#include "timer.h"
 
 enum http_parser_retcode {
     HTTP_PARSER_INVALID_METHOD = 10,
@@ -22,19 +28,68 @@ enum http_method {
 
 enum http_status {
     HTTP_OK = 200,
+    HTTP_PARTIAL_CONTENT = 206,
     HTTP_NOT_MODIFIED = 304,
+    HTTP_BAD_REQUEST = 400,
+    HTTP_FORBIDDEN = 403,
     HTTP_NOT_FOUND = 404,
+    HTTP_LENGTH_REQUIRED = 411,
+    HTTP_CONTENT_TOO_LARGE = 413,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
+    HTTP_HEADER_TOO_LARGE = 431,
+    HTTP_INTERNAL_ERROR = 500,
+    HTTP_BAD_GATEWAY = 502,
+    HTTP_SERVICE_UNAVAILABLE = 503,
 };
 
-#define MAX_BUF 8124
+/* content codings; http_out_t.encodings has bit 1 << coding for each one
+ * the client accepts
+ */
+enum http_encoding {
+    HTTP_ENC_IDENTITY = 0,
+    HTTP_ENC_GZIP,
+    HTTP_ENC_BR,
+    HTTP_ENC_COUNT
+};
+
+#define RESP_HEADER_LEN 512
+#define HTTP_MAX_PIPELINE 16 /* responses sent in one batch */
+#define HTTP_MAX_HEADER 8192   /* request line and headers */
+#define HTTP_MAX_RANGES 8      /* more than that and Range is ignored */
+
+/* where a request split across receives stopped */
+enum http_parse_phase {
+    HTTP_PARSE_IDLE = 0,
+    HTTP_PARSE_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY, /* of a proxied request, see proxy_body_len() */
+};
+#define IN_QUEUE_LEN 8
+
+struct file_entry;
+struct proxy_conn;
+
+/* One part of a multipart/byteranges body: its header, then @len bytes of
+ * the file from @off. The closing boundary is a part without bytes.
+ */
+typedef struct {
+    char *hdr;
+    size_t hdr_len;
+    off_t off;
+    size_t len;
+} http_part_t;
 
 typedef struct {
     void *root;
-    int fd;
+    int fd; /* slot in the registered file table when fixed_file is set */
+    bool fixed_file;
     int epfd;
-    char *buf; /* ring buffer */
+    char *buf; /* the received bytes, parsed in place */
     size_t pos, last;
     int state;
+    int phase;      /* enum http_parse_phase */
+    size_t req_off; /* where the request being parsed starts in buf */
+    char *inbuf;    /* holds a request that arrived in pieces */
     void *request_start;
     int method;
     void *uri_start, *uri_end;
@@ -47,8 +102,49 @@ typedef struct {
 
     bool keep_alive;
     int pool_id;
+    void *pool_next; /* free list link while the object is in the pool */
     int bid;
-    int event_type;
+
+    /* connection state for the multishot engine */
+    bool busy;       /* a response is in flight */
+    bool recv_armed; /* a multishot recv is in flight */
+    bool closing;    /* close once neither of the above holds */
+    bool recv_paused; /* the queue filled up, the recv is cancelled */
+    unsigned short in_bid[IN_QUEUE_LEN]; /* received, not yet handled */
+    int in_len[IN_QUEUE_LEN];
+    int in_head, in_count;
+    char *spill; /* what arrived before the cancel took, after the queue */
+    size_t spill_len;
+    bool starved; /* the recv found no buffer, waits for one on the list */
+    struct list_head starved_link;
+
+    /* file body in flight, moved file -> pipe -> socket by splice */
+    struct file_entry *file; /* holds a file cache reference */
+    off_t file_off;
+    size_t file_left;
+    int pipefd[2];
+    size_t pipe_len; /* bytes spliced into the pipe but not yet sent */
+    http_part_t *parts; /* multipart body, in the arena */
+    int nr_parts, cur_part;
+
+    /* a request routed to an upstream, see proxy.c */
+    int route;       /* proxy route of the request being parsed, or -1 */
+    size_t body_len; /* its body, which is forwarded along */
+    struct proxy_conn *upstream;
+
+    timer_node_t timer; /* header-read, keep-alive or write-stall deadline */
+    uint64_t started;   /* when the input of the batch was taken up, usec */
+    int batch;          /* responses in the batch in flight */
+    arena_t arena;      /* headers and response state, reset per request */
+
+    /* Responses to pipelined requests go out as one batch. Headers live in
+     * the arena, cached bodies are pinned by the references in held[].
+     */
+    struct iovec iov[2 * HTTP_MAX_PIPELINE]; /* what is left of the batch */
+    int iovcnt;
+    struct file_entry *held[HTTP_MAX_PIPELINE];
+    int nr_held;
+    struct msghdr msg;
 } http_request_t;
 
 typedef struct {
@@ -59,6 +155,14 @@ typedef struct {
                     * whether the file is modified since last time
                     */
     int status;
+    unsigned encodings; /* from Accept-Encoding */
+    const char *range;  /* value of Range, resolved once the size is known */
+    int range_len;
+    bool range_stale; /* If-Range did not match, send the whole file */
+    const char *etag; /* entity tag of the file as it is on disk */
+    size_t etag_len;
+    const char *if_none_match; /* checked against the response chosen */
+    int if_none_match_len;
 } http_out_t;
 
 typedef struct {
@@ -72,28 +176,98 @@ typedef int (*http_header_handler)(http_request_t *r,
                                    char *data,
                                    int len);
 
-typedef struct {
-    char *name;
-    http_header_handler handler;
-} http_header_handle_t;
-
 void http_handle_header(http_request_t *r, http_out_t *o);
+void http_handle_connection(http_request_t *r, http_out_t *o);
+bool http_etag_listed(const char *list,
+                      int len,
+                      const char *etag,
+                      size_t etag_len);
 int http_close_conn(http_request_t *r);
 
 static inline void init_http_request(http_request_t *r, int fd, char *root)
 {
     r->fd = fd;
+    r->fixed_file = false;
     r->pos = r->last = 0;
     r->state = 0;
+    r->phase = HTTP_PARSE_IDLE;
+    r->inbuf = NULL;
     r->root = root;
     r->keep_alive = true;
     INIT_LIST_HEAD(&(r->list));
+    r->busy = r->recv_armed = r->closing = r->recv_paused = false;
+    r->in_head = r->in_count = 0;
+    r->spill = NULL;
+    r->spill_len = 0;
+    r->starved = false;
+    r->file = NULL;
+    r->file_off = 0;
+    r->file_left = 0;
+    r->pipefd[0] = r->pipefd[1] = -1;
+    r->pipe_len = 0;
+    r->parts = NULL;
+    r->nr_parts = r->cur_part = 0;
+    r->route = -1;
+    r->body_len = 0;
+    r->upstream = NULL;
+    r->bid = -1;
+    r->iovcnt = r->nr_held = 0;
+    r->batch = 0;
+    r->timer.armed = false;
+    arena_init(&r->arena);
 }
 
+/* Account for @n sent bytes; returns true if part of the send is left. */
+static inline bool http_send_advance(http_request_t *r, size_t n)
+{
+    int i = 0;
+    while (i < r->iovcnt && n >= r->iov[i].iov_len)
+        n -= r->iov[i++].iov_len;
+    if (i == r->iovcnt)
+        return false;
+
+    r->iov[i].iov_base = (char *) r->iov[i].iov_base + n;
+    r->iov[i].iov_len -= n;
+    for (int k = i; k < r->iovcnt; k++)
+        r->iov[k - i] = r->iov[k];
+    r->iovcnt -= i;
+    return true;
+}
+
+static inline bool http_body_pending(http_request_t *r)
+{
+    return r->file_left > 0 || r->pipe_len > 0;
+}
+
+/* received bytes not parsed yet, i.e. more pipelined requests */
+static inline bool http_input_pending(http_request_t *r)
+{
+    return r->pos < r->last;
+}
+
+/* the start of a request arrived, the rest has yet to */
+static inline bool http_request_partial(http_request_t *r)
+{
+    return r->phase != HTTP_PARSE_IDLE;
+}
+
+void http_init();
+void http_clock_tick();
+
 /* TODO: public functions should have conventions to prefix http_ */
-void do_request(void *infd, int n);
+int do_request(void *infd, int n);
+int http_input(http_request_t *r, char *in, int n);
+int http_serve(http_request_t *r);
+void http_send_error(http_request_t *r, int status_code);
+char *http_append_connection(char *p, bool keep_alive);
+bool http_next_part(http_request_t *r);
+void http_response_done(http_request_t *r);
 
 int http_parse_request_line(http_request_t *r);
 int http_parse_request_body(http_request_t *r);
+void http_parse_uri(const char *root,
+                    char *uri,
+                    int uri_length,
+                    char *filename);
 
 #endif
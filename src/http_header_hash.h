@@ -0,0 +1,88 @@
+/* Generated by scripts/gen-header-hash.py, do not edit. */
+#ifndef HTTP_HEADER_HASH_H
+#define HTTP_HEADER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+enum http_header_id {
+    HTTP_HDR_UNKNOWN = 0,
+    HTTP_HDR_ACCEPT,
+    HTTP_HDR_ACCEPT_ENCODING,
+    HTTP_HDR_ACCEPT_LANGUAGE,
+    HTTP_HDR_AUTHORIZATION,
+    HTTP_HDR_CACHE_CONTROL,
+    HTTP_HDR_CONNECTION,
+    HTTP_HDR_CONTENT_LENGTH,
+    HTTP_HDR_CONTENT_TYPE,
+    HTTP_HDR_COOKIE,
+    HTTP_HDR_EXPECT,
+    HTTP_HDR_HOST,
+    HTTP_HDR_IF_MATCH,
+    HTTP_HDR_IF_MODIFIED_SINCE,
+    HTTP_HDR_IF_NONE_MATCH,
+    HTTP_HDR_IF_RANGE,
+    HTTP_HDR_IF_UNMODIFIED_SINCE,
+    HTTP_HDR_KEEP_ALIVE,
+    HTTP_HDR_RANGE,
+    HTTP_HDR_REFERER,
+    HTTP_HDR_TRANSFER_ENCODING,
+    HTTP_HDR_UPGRADE,
+    HTTP_HDR_USER_AGENT,
+    HTTP_HDR_COUNT
+};
+
+#define HTTP_HDR_MIN_LEN 4
+#define HTTP_HDR_MAX_LEN 19
+
+static const uint8_t http_header_asso[256] = {
+    [97] = 22, [99] = 12, [101] = 19, [103] = 7, [104] = 26, [105] = 54,
+    [107] = 5, [108] = 6, [110] = 11, [114] = 60, [116] = 47, [117] = 12,
+};
+
+static const struct {
+    const char *name;
+    uint8_t len, id;
+} http_header_slots[64] = {
+    [5] = {"User-Agent", 10, HTTP_HDR_USER_AGENT},
+    [7] = {"Transfer-Encoding", 17, HTTP_HDR_TRANSFER_ENCODING},
+    [8] = {"Expect", 6, HTTP_HDR_EXPECT},
+    [11] = {"Accept", 6, HTTP_HDR_ACCEPT},
+    [13] = {"Host", 4, HTTP_HDR_HOST},
+    [17] = {"If-Range", 8, HTTP_HDR_IF_RANGE},
+    [20] = {"Range", 5, HTTP_HDR_RANGE},
+    [24] = {"If-Match", 8, HTTP_HDR_IF_MATCH},
+    [26] = {"If-Modified-Since", 17, HTTP_HDR_IF_MODIFIED_SINCE},
+    [28] = {"If-Unmodified-Since", 19, HTTP_HDR_IF_UNMODIFIED_SINCE},
+    [29] = {"If-None-Match", 13, HTTP_HDR_IF_NONE_MATCH},
+    [31] = {"Cache-Control", 13, HTTP_HDR_CACHE_CONTROL},
+    [33] = {"Connection", 10, HTTP_HDR_CONNECTION},
+    [34] = {"Keep-Alive", 10, HTTP_HDR_KEEP_ALIVE},
+    [37] = {"Cookie", 6, HTTP_HDR_COOKIE},
+    [38] = {"Upgrade", 7, HTTP_HDR_UPGRADE},
+    [43] = {"Content-Type", 12, HTTP_HDR_CONTENT_TYPE},
+    [44] = {"Accept-Encoding", 15, HTTP_HDR_ACCEPT_ENCODING},
+    [46] = {"Authorization", 13, HTTP_HDR_AUTHORIZATION},
+    [52] = {"Content-Length", 14, HTTP_HDR_CONTENT_LENGTH},
+    [56] = {"Accept-Language", 15, HTTP_HDR_ACCEPT_LANGUAGE},
+    [63] = {"Referer", 7, HTTP_HDR_REFERER},
+};
+
+/* One hash, one length check and at most one compare. */
+static inline enum http_header_id http_header_lookup(const char *key,
+                                                     size_t len)
+{
+    if (len < HTTP_HDR_MIN_LEN || len > HTTP_HDR_MAX_LEN)
+        return HTTP_HDR_UNKNOWN;
+
+    unsigned h = (len + http_header_asso[(uint8_t) key[0] | 0x20] +
+                  http_header_asso[(uint8_t) key[len - 1] | 0x20]) &
+                 63;
+    if (http_header_slots[h].len != len ||
+        strncasecmp(http_header_slots[h].name, key, len))
+        return HTTP_HDR_UNKNOWN;
+    return http_header_slots[h].id;
+}
+
+#endif
@@ -1,13 +1,12 @@
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE /* for the sake of strptime(3) */
-#endif
-
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "file_cache.h"
 #include "http.h"
+#include "http_header_hash.h"
 #include "memory_pool.h"
+#include "uring.h"
 
 int http_close_conn(http_request_t *r)
 {
@@ -17,79 +16,283 @@ int http_close_conn(http_request_t *r)
      * underlying open file description have been closed (or before if the
      * descriptor is explicitly removed using epoll_ctl(2) EPOLL_CTL_DEL).
      */
-    close(r->fd);
+    if (r->fixed_file)
+        add_close_direct(r->fd);
+    else
+        close(r->fd);
+    timer_cancel(&r->timer);
+    arena_reset(&r->arena);
+    http_response_done(r);
+    free(r->inbuf);
+    r->inbuf = NULL;
+    free(r->spill);
+    r->spill = NULL;
+    if (r->pipefd[0] >= 0) {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+    }
     free_request(r);
     return 0;
 }
 
-static int http_process_ignore(http_request_t *r UNUSED,
-                               http_out_t *out UNUSED,
-                               char *data UNUSED,
-                               int len UNUSED)
-{
-    return 0;
-}
-
 static int http_process_connection(http_request_t *r UNUSED,
                                    http_out_t *out,
                                    char *data,
                                    int len)
 {
-    if (!strncasecmp("keep-alive", data, len))
+    if (len == 10 && !strncasecmp("keep-alive", data, len))
         out->keep_alive = true;
+    else if (len == 5 && !strncasecmp("close", data, len))
+        out->keep_alive = false;
     return 0;
 }
 
+static inline bool is_token_end(char c)
+{
+    return c == ',' || c == ';' || c == ' ' || c == '\t';
+}
+
+/* "q=0", "q=0.0" and so on refuse a coding, any other weight accepts it */
+static bool refused(const char *p, const char *end)
+{
+    while (p < end && *p != ',') {
+        if (*p == ';') {
+            for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+                ;
+            if (end - p > 2 && (p[0] | 0x20) == 'q' && p[1] == '=') {
+                for (p += 2; p < end && (*p == '0' || *p == '.'); p++)
+                    ;
+                return p == end || is_token_end(*p);
+            }
+        }
+        p++;
+    }
+    return false;
+}
 
-void absf(double *x)
+/* Which of the codings we can produce the client takes. Weights other
+ * than zero are not ranked, the server picks br over gzip.
+ */
+static int http_process_accept_encoding(http_request_t *r UNUSED,
+                                        http_out_t *out,
+                                        char *data,
+                                        int len)
 {
-    int a = 0x1;
-    char little_end = *((char *) &a);
-    *(((int *) x) + little_end) &= 0x7fffffff;
+    const unsigned all = (1u << HTTP_ENC_GZIP) | (1u << HTTP_ENC_BR);
+    unsigned listed = 0, accepted = 0;
+    bool star = false;
+    char *end = data + len;
+
+    while (data < end) {
+        while (data < end && (*data == ',' || *data == ' ' || *data == '\t'))
+            data++;
+        char *name = data;
+        while (data < end && !is_token_end(*data))
+            data++;
+        int n = data - name;
+
+        unsigned bit = 0;
+        if ((n == 4 && !strncasecmp(name, "gzip", 4)) ||
+            (n == 6 && !strncasecmp(name, "x-gzip", 6)))
+            bit = 1u << HTTP_ENC_GZIP;
+        else if (n == 2 && !strncasecmp(name, "br", 2))
+            bit = 1u << HTTP_ENC_BR;
+        else if (n == 1 && *name == '*')
+            bit = all;
+
+        bool ok = !refused(data, end);
+        if (bit == all) {
+            star = ok;
+        } else if (bit) {
+            listed |= bit;
+            if (ok)
+                accepted |= bit;
+        }
+        while (data < end && *data != ',')
+            data++;
+    }
+
+    out->encodings = accepted | (star ? all & ~listed : 0);
+    return 0;
+}
+
+static inline int digit(char c)
+{
+    return (unsigned) (c - '0') < 10 ? c - '0' : -1000;
+}
+
+/* days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static long days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    long era = y / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", the format every current
+ * client sends. Each field sits at a fixed offset, so parsing is a fixed
+ * number of steps with no locale, time zone or allocation involved; any
+ * other format gives -1 and the header is ignored.
+ */
+static time_t parse_http_date(const char *s, int len)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (len < 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' ||
+        s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':' ||
+        memcmp(s + 25, " GMT", 4))
+        return -1;
+
+    int month = 0;
+    for (int i = 0; i < 12; i++) {
+        if (!memcmp(s + 8, months + 3 * i, 3))
+            month = i + 1;
+    }
+    int day = digit(s[5]) * 10 + digit(s[6]);
+    int year = digit(s[12]) * 1000 + digit(s[13]) * 100 + digit(s[14]) * 10 +
+               digit(s[15]);
+    int hour = digit(s[17]) * 10 + digit(s[18]);
+    int min = digit(s[20]) * 10 + digit(s[21]);
+    int sec = digit(s[23]) * 10 + digit(s[24]);
+    if (!month || day < 1 || day > 31 || year < 1970 || hour < 0 ||
+        hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+        return -1;
+
+    return (time_t) days_from_civil(year, month, day) * 86400 + hour * 3600 +
+           min * 60 + sec;
 }
 
 static int http_process_if_modified_since(http_request_t *r UNUSED,
                                           http_out_t *out,
                                           char *data,
-                                          int len UNUSED)
+                                          int len)
 {
-    struct tm tm;
-    if (!strptime(data, "%a, %d %b %Y %H:%M:%S GMT", &tm))
-        return 0;
-
-    time_t client_time = mktime(&tm);
-    double time_diff = difftime(out->mtime, client_time);
-    absf(&time_diff);
-    if (time_diff < 1e-6) { /* Not modified */
+    time_t since = parse_http_date(data, len);
+    if (since >= 0 && out->mtime <= since) { /* Not modified */
         out->modified = false;
         out->status = HTTP_NOT_MODIFIED;
     }
     return 0;
 }
 
-static http_header_handle_t http_headers_in[] = {
-    {"Host", http_process_ignore},
-    {"Connection", http_process_connection},
-    {"If-Modified-Since", http_process_if_modified_since},
-    {"", http_process_ignore}};
+/* Checked once the response is chosen, see http_etag_listed(); it takes
+ * precedence over If-Modified-Since.
+ */
+static int http_process_if_none_match(http_request_t *r UNUSED,
+                                      http_out_t *out,
+                                      char *data,
+                                      int len)
+{
+    out->if_none_match = data;
+    out->if_none_match_len = len;
+    return 0;
+}
+
+/* Does the If-None-Match list @list name @etag? Comparison is weak, so
+ * W/"x" matches "x", and "*" matches anything.
+ */
+bool http_etag_listed(const char *list,
+                      int len,
+                      const char *etag,
+                      size_t etag_len)
+{
+    const char *end = list + len;
+
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == '\t' || *list == ','))
+            list++;
+        if (list == end)
+            break;
+        if (*list == '*')
+            return true;
+        if (end - list > 2 && list[0] == 'W' && list[1] == '/')
+            list += 2;
+
+        const char *tag = list;
+        if (list < end && *list == '"') {
+            const char *close = memchr(list + 1, '"', end - list - 1);
+            list = close ? close + 1 : end;
+        }
+        if ((size_t) (list - tag) == etag_len && !memcmp(tag, etag, etag_len))
+            return true;
+        while (list < end && *list != ',')
+            list++;
+    }
+    return false;
+}
+
+static int http_process_range(http_request_t *r UNUSED,
+                              http_out_t *out,
+                              char *data,
+                              int len)
+{
+    out->range = data;
+    out->range_len = len;
+    return 0;
+}
+
+/* Ranges only apply to the version of the file the client already has
+ * part of: the entity tag has to match strongly, a date has to be exactly
+ * the Last-Modified we sent.
+ */
+static int http_process_if_range(http_request_t *r UNUSED,
+                                 http_out_t *out,
+                                 char *data,
+                                 int len)
+{
+    if (*data == '"')
+        out->range_stale = (size_t) len < out->etag_len ||
+                           memcmp(data, out->etag, out->etag_len) ||
+                           ((size_t) len > out->etag_len &&
+                            data[out->etag_len] != ' ');
+    else
+        out->range_stale = parse_http_date(data, len) != out->mtime;
+    return 0;
+}
+
+/* indexed by the perfect hash; headers without a handler are skipped */
+static const http_header_handler http_headers_in[HTTP_HDR_COUNT] = {
+    [HTTP_HDR_ACCEPT_ENCODING] = http_process_accept_encoding,
+    [HTTP_HDR_CONNECTION] = http_process_connection,
+    [HTTP_HDR_IF_MODIFIED_SINCE] = http_process_if_modified_since,
+    [HTTP_HDR_IF_NONE_MATCH] = http_process_if_none_match,
+    [HTTP_HDR_IF_RANGE] = http_process_if_range,
+    [HTTP_HDR_RANGE] = http_process_range,
+};
 
 void http_handle_header(http_request_t *r, http_out_t *o)
 {
     list_head *pos;
     list_for_each (pos, &(r->list)) {
         http_header_t *header = list_entry(pos, http_header_t, list);
-        for (http_header_handle_t *header_in = http_headers_in;
-             strlen(header_in->name) > 0; header_in++) {
-            if (!strncmp(header->key_start, header_in->name,
-                         header->key_end - header->key_start)) {
-                int len = header->value_end - header->value_start;
-                (*(header_in->handler))(r, o, header->value_start, len);
-                break;
-            }
+        enum http_header_id id = http_header_lookup(
+            header->key_start, header->key_end - header->key_start);
+        if (http_headers_in[id]) {
+            int len = header->value_end - header->value_start;
+            http_headers_in[id](r, o, header->value_start, len);
         }
 
-        /* delete it from the original list */
+        /* delete it from the original list; the arena owns the memory */
+        list_del(pos);
+    }
+}
+
+/* Only what concerns our side of the connection: the validators of a
+ * proxied request are for the upstream, it gets them as they are.
+ */
+void http_handle_connection(http_request_t *r, http_out_t *o)
+{
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *header = list_entry(pos, http_header_t, list);
+        if (http_header_lookup(header->key_start,
+                               header->key_end - header->key_start) ==
+            HTTP_HDR_CONNECTION)
+            http_process_connection(r, o, header->value_start,
+                                    header->value_end - header->value_start);
         list_del(pos);
-        free(header);
     }
 }
@@ -0,0 +1,110 @@
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCAN
+#endif
+
+#include "http_scan.h"
+
+/* The parser only needs to look closely at a handful of delimiters; the
+ * bytes in between (long cookies, user agents, URIs) are skipped here as
+ * many at a time as the CPU allows. Vector loads never go past @end, the
+ * remainder is finished byte by byte.
+ */
+static const uint8_t *scan_scalar(const uint8_t *p,
+                                  const uint8_t *end,
+                                  uint8_t c0,
+                                  uint8_t c1)
+{
+    while (p < end && *p != c0 && *p != c1)
+        p++;
+    return p;
+}
+
+#ifdef HAVE_X86_SCAN
+__attribute__((target("sse4.2"))) static const uint8_t *scan_sse42(
+    const uint8_t *p,
+    const uint8_t *end,
+    uint8_t c0,
+    uint8_t c1)
+{
+    const __m128i set = _mm_setr_epi8(c0, c1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(set, 2, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                 _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+    }
+    return scan_scalar(p, end, c0, c1);
+}
+
+__attribute__((target("avx2"))) static const uint8_t *scan_avx2(
+    const uint8_t *p,
+    const uint8_t *end,
+    uint8_t c0,
+    uint8_t c1)
+{
+    const __m256i v0 = _mm256_set1_epi8(c0);
+    const __m256i v1 = _mm256_set1_epi8(c1);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, v0), _mm256_cmpeq_epi8(v, v1)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_scalar(p, end, c0, c1);
+}
+#endif
+
+http_scan_fn http_scan = scan_scalar;
+static const char *scan_name = "scalar";
+
+/* Returns -1, leaving the current choice alone, if the CPU lacks @impl. */
+int http_scan_init(enum http_scan_impl impl)
+{
+#ifdef HAVE_X86_SCAN
+    __builtin_cpu_init();
+    if (impl == HTTP_SCAN_AUTO) {
+        if (__builtin_cpu_supports("avx2"))
+            impl = HTTP_SCAN_AVX2;
+        else if (__builtin_cpu_supports("sse4.2"))
+            impl = HTTP_SCAN_SSE42;
+        else
+            impl = HTTP_SCAN_SCALAR;
+    }
+
+    switch (impl) {
+    case HTTP_SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return -1;
+        http_scan = scan_avx2;
+        scan_name = "avx2";
+        return 0;
+    case HTTP_SCAN_SSE42:
+        if (!__builtin_cpu_supports("sse4.2"))
+            return -1;
+        http_scan = scan_sse42;
+        scan_name = "sse4.2";
+        return 0;
+    default:
+        break;
+    }
+#endif
+    if (impl != HTTP_SCAN_AUTO && impl != HTTP_SCAN_SCALAR)
+        return -1;
+    http_scan = scan_scalar;
+    scan_name = "scalar";
+    return 0;
+}
+
+const char *http_scan_name()
+{
+    return scan_name;
+}
@@ -0,0 +1,25 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stdint.h>
+
+/* Returns the first byte in [p, end) equal to c0 or c1, or end. */
+typedef const uint8_t *(*http_scan_fn)(const uint8_t *p,
+                                       const uint8_t *end,
+                                       uint8_t c0,
+                                       uint8_t c1);
+
+enum http_scan_impl {
+    HTTP_SCAN_AUTO = -1, /* the widest one the CPU supports */
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+};
+
+/* scalar until http_scan_init() picks something better */
+extern http_scan_fn http_scan;
+
+int http_scan_init(enum http_scan_impl impl);
+const char *http_scan_name();
+
+#endif
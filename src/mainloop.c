@@ -1,17 +1,30 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of pthread_setaffinity_np(3) */
+#endif
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <liburing.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "file_cache.h"
 #include "http.h"
 #include "logger.h"
 #include "memory_pool.h"
+#include "metrics.h"
+#include "probes.h"
+#include "proxy.h"
+#include "timer.h"
 #include "uring.h"
 
 /* the length of the struct epoll_events array pointed to by *events */
@@ -23,6 +36,14 @@
 #define write 2
 #define prov_buf 3
 #define uring_timer 4
+#define splice_in 5
+#define splice_out 6
+#define inotify 7
+#define clock_tick 8
+#define detached 9
+#define upstream_connect 10
+#define upstream_send 11
+#define upstream_recv 12
 
 static int open_listenfd(int port)
 {
@@ -37,6 +58,13 @@ static int open_listenfd(int port)
                    sizeof(int)) < 0)
         return -1;
 
+    /* Every worker binds its own socket to the same port and the kernel
+     * load-balances incoming connections between them.
+     */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval,
+                   sizeof(int)) < 0)
+        return -1;
+
     /* Listenfd will be an endpoint for all requests to given port. */
     struct sockaddr_in serveraddr = {
         .sin_family = AF_INET,
@@ -57,21 +85,498 @@ static int open_listenfd(int port)
 #define PORT 8081
 #define WEBROOT "./www"
 
-int main()
+/* engine selected on the command line, and what each worker ended up with
+ * after probing the kernel
+ */
+static bool use_multishot;
+static __thread bool multishot_accept, multishot_recv;
+
+/* accept sockets into the registered file table unless -D is given */
+static bool use_direct = true;
+
+/* ring setup from -p; SQPOLL pollers are spread over consecutive CPUs */
+static ring_params_t ring_params = {
+    .profile = RING_DEFAULT,
+    .sq_cpu = -1,
+    .sq_idle = SQPOLL_DEFAULT_IDLE_MSEC,
+};
+
+/* Pool object, and hence table slot, the next one-shot direct accept
+ * fills.
+ */
+static __thread http_request_t *next_conn;
+
+/* Wakes a pending recv with EOF and fails a pending send; their CQEs get
+ * us back to conn_close().
+ */
+static void hang_up(http_request_t *r)
+{
+    if (r->fixed_file)
+        add_shutdown_request(r);
+    else
+        shutdown(r->fd, SHUT_RDWR);
+}
+
+/* Connections whose recv found the buffer ring empty, oldest first. Every
+ * buffer given back re-arms one of them once the completions at hand are
+ * handled, rather than having them spin on -ENOBUFS or be dropped. Their
+ * bytes are in the socket already, so the wait does not count against the
+ * client.
+ */
+static __thread struct list_head starved;
+static __thread unsigned bufs_returned;
+
+static void return_buf(int bid)
 {
+    add_provide_buf(bid);
+    bufs_returned++;
+}
+
+/* A request arriving in pieces has to be complete in time, every piece
+ * does not buy it more.
+ */
+static void arm_input_timer(http_request_t *r)
+{
+    if (!http_request_partial(r))
+        timer_arm(&r->timer, TIMER_IDLE);
+    else if (!r->timer.armed || r->timer.kind != TIMER_HEADER)
+        timer_arm(&r->timer, TIMER_HEADER);
+}
+
+static void wake_starved()
+{
+    for (; bufs_returned && !list_empty(&starved); bufs_returned--) {
+        http_request_t *r =
+            list_entry(starved.next, http_request_t, starved_link);
+        list_del(&r->starved_link);
+        r->starved = false;
+        if (!r->busy)
+            arm_input_timer(r);
+        if (multishot_recv)
+            add_multishot_read(r);
+        else
+            add_read_request(r);
+    }
+    bufs_returned = 0;
+}
+
+/* Hand the receive buffer back once every request in it is answered. */
+static void release_input(http_request_t *r)
+{
+    if (r->bid < 0)
+        return;
+    return_buf(r->bid);
+    r->bid = -1;
+}
+
+static void finish_response(http_request_t *r);
+
+static inline uint64_t now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); /* vDSO, no system call */
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Hang up once nothing is in flight for the connection any more. */
+static void conn_close(http_request_t *r)
+{
+    r->closing = true;
+    if (r->starved) {
+        list_del(&r->starved_link);
+        r->starved = false;
+    }
+    if (r->recv_armed) {
+        hang_up(r);
+        return;
+    }
+    if (r->busy)
+        return;
+
+    PROBE1(closed, r);
+    release_input(r);
+    while (r->in_count) {
+        return_buf(r->in_bid[r->in_head]);
+        r->in_head = (r->in_head + 1) % IN_QUEUE_LEN;
+        r->in_count--;
+    }
+    int ret = http_close_conn(r);
+    assert(ret == 0 && "http_close_conn");
+}
+
+/* Park input that completes after the queue filled up, in arrival order,
+ * until the queue drains; more than a request header's worth is too much.
+ */
+static bool spill_input(http_request_t *r, const char *in, int len)
+{
+    if (r->spill_len + len > HTTP_MAX_HEADER)
+        return false;
+    if (!r->spill && !(r->spill = malloc(HTTP_MAX_HEADER)))
+        return false;
+    memcpy(r->spill + r->spill_len, in, len);
+    r->spill_len += len;
+    return true;
+}
+
+static void dispatch_input(http_request_t *r)
+{
+    int len = r->in_len[r->in_head];
+    r->bid = r->in_bid[r->in_head];
+    r->in_head = (r->in_head + 1) % IN_QUEUE_LEN;
+    r->in_count--;
+
+    r->busy = true;
+    r->started = now_usec();
+    r->batch = do_request(r, len);
+    if (r->batch)
+        timer_arm(&r->timer, TIMER_WRITE);
+    else
+        finish_response(r); /* blank lines or part of a request */
+}
+
+/* The spill is only filled while the recv is winding down and only served
+ * once it has, so it holds still until the batch is out.
+ */
+static void dispatch_spill(http_request_t *r)
+{
+    int len = r->spill_len;
+    r->spill_len = 0;
+
+    r->busy = true;
+    r->started = now_usec();
+    r->batch = http_input(r, r->spill, len);
+    if (r->batch)
+        timer_arm(&r->timer, TIMER_WRITE);
+    else
+        finish_response(r);
+}
+
+/* Nothing is being answered: serve what is queued or wait for the next
+ * request. A paused recv is re-armed once its last completion is in and
+ * everything received before it is served.
+ */
+static void wait_input(http_request_t *r)
+{
+    if (r->in_count) {
+        dispatch_input(r);
+        return;
+    }
+    if (r->recv_paused && r->recv_armed) {
+        timer_arm(&r->timer, TIMER_IDLE); /* in case the cancel missed */
+        return;
+    }
+    if (r->spill_len) {
+        dispatch_spill(r);
+        return;
+    }
+    if (r->starved)
+        return; /* wake_starved() re-arms it */
+
+    arm_input_timer(r);
+    if (!multishot_recv) {
+        add_read_request(r);
+    } else if (r->recv_paused) {
+        r->recv_paused = false;
+        add_multishot_read(r);
+    }
+}
+
+/* Input that arrives while a response is still going out waits its turn.
+ * A client that pipelines faster than it reads fills the queue; the recv is
+ * then cancelled rather than the connection dropped, and what still comes
+ * in before the cancel takes is spilled.
+ */
+static void on_read(http_request_t *r, struct io_uring_cqe *cqe)
+{
+    int read_bytes = cqe->res;
+    bool more = multishot_recv && (cqe->flags & IORING_CQE_F_MORE);
+
+    if (!more)
+        r->recv_armed = false;
+
+    if (read_bytes > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        METRICS_INC(recvs);
+        METRICS_ADD(recv_bytes, read_bytes);
+        PROBE2(received, r, read_bytes);
+        if (r->closing) {
+            return_buf(bid);
+        } else if (r->in_count == IN_QUEUE_LEN || r->spill_len) {
+            bool kept = spill_input(r, get_bufs(bid), read_bytes);
+            return_buf(bid);
+            if (!kept) {
+                conn_close(r);
+                return;
+            }
+        } else {
+            int tail = (r->in_head + r->in_count) % IN_QUEUE_LEN;
+            r->in_bid[tail] = bid;
+            r->in_len[tail] = read_bytes;
+            r->in_count++;
+            if (!r->busy)
+                dispatch_input(r);
+        }
+        if (r->in_count == IN_QUEUE_LEN && !r->recv_paused && !r->closing) {
+            r->recv_paused = true;
+            if (more)
+                add_cancel_read(r);
+        }
+    }
+
+    if (more || (!multishot_recv && read_bytes > 0))
+        return;
+
+    if (read_bytes == -ENOBUFS)
+        METRICS_INC(buf_starved);
+
+    /* the cancel took, or the recv ended anyway: resume once drained */
+    if (r->recv_paused && !r->closing &&
+        (read_bytes > 0 || read_bytes == -ENOBUFS ||
+         read_bytes == -ECANCELED)) {
+        if (!r->busy)
+            wait_input(r);
+        return;
+    }
+
+    if (multishot_recv && read_bytes == -EINVAL) {
+        multishot_recv = false; /* kernel predates multishot recv */
+        add_read_request(r);
+        return;
+    }
+
+    /* the bytes stay in the socket until a buffer comes back */
+    if (read_bytes == -ENOBUFS && !r->closing) {
+        r->starved = true;
+        list_add_tail(&r->starved_link, &starved);
+        if (!r->busy)
+            timer_cancel(&r->timer);
+        return;
+    }
+
+    /* the multishot recv terminated: re-arm unless it was EOF or an error */
+    if (multishot_recv && !r->closing && read_bytes > 0) {
+        add_multishot_read(r);
+        return;
+    }
+
+    conn_close(r);
+}
+
+static void on_response_error(http_request_t *r)
+{
+    release_input(r);
+    r->busy = false;
+    conn_close(r);
+}
+
+/* The whole batch went out: answer the pipelined requests still in the
+ * buffer, serve what is queued, wait for the next request or hang up.
+ */
+static void finish_response(http_request_t *r)
+{
+    /* pipelined requests count from when the batch they came in started */
+    if (r->batch) {
+        metrics_latency(now_usec() - r->started, r->batch);
+        PROBE2(done, r, r->batch);
+    }
+    r->batch = 0;
+
+    http_response_done(r);
+    if (r->keep_alive && !r->closing && http_input_pending(r) &&
+        (r->batch = http_serve(r))) {
+        timer_arm(&r->timer, TIMER_WRITE);
+        return;
+    }
+
+    release_input(r);
+    r->busy = false;
+
+    if (r->keep_alive == false || r->closing)
+        conn_close(r);
+    else
+        wait_input(r);
+}
+
+/* What was queued is out and no file bytes are left: send the next part of
+ * a multipart body, go on with a proxied response, or the response is
+ * complete.
+ */
+static void finish_body(http_request_t *r)
+{
+    if (http_next_part(r)) {
+        timer_arm(&r->timer, TIMER_WRITE);
+        add_send_request(r);
+    } else if (proxy_continue(r)) {
+        timer_arm(&r->timer, TIMER_WRITE);
+    } else {
+        finish_response(r);
+    }
+}
+
+/* The upstream side of a proxied request made progress; waiting for it
+ * counts against the same deadline as a client that does not read.
+ */
+static void on_upstream(http_request_t *r, int type, int res)
+{
+    int rc = proxy_complete(r, type, res);
+    if (rc < 0)
+        on_response_error(r);
+    else if (rc > 0)
+        finish_body(r);
+    else
+        timer_arm(&r->timer, TIMER_WRITE);
+}
+
+/* A deadline passed: whatever the connection was waiting for, give up. */
+static void on_expire(timer_node_t *t)
+{
+    http_request_t *r = list_entry(t, http_request_t, timer);
+
+    METRICS_INC(timeouts);
+    PROBE2(expired, r, t->kind);
+    r->closing = true;
+    proxy_abort(r);
+    if (r->busy || r->recv_armed)
+        hang_up(r);
+    else
+        conn_close(r);
+}
+
+/* The accept tag remembers whether it was armed for a direct descriptor so
+ * the completion can be decoded after the mode changed.
+ */
+static void arm_accept(int listenfd,
+                       http_request_t *tag,
+                       struct sockaddr_in *client_addr,
+                       socklen_t *client_len)
+{
+    tag->fixed_file = false;
+    if (multishot_accept) {
+        tag->fixed_file = uring_fixed_files();
+        add_multishot_accept(listenfd, tag);
+        return;
+    }
+
+    if (uring_fixed_files()) {
+        if (!next_conn)
+            next_conn = get_request();
+        if (next_conn &&
+            (unsigned) next_conn->pool_id >= uring_fixed_files()) {
+            /* no slot of its own in a table cut short by RLIMIT_NOFILE */
+            free_request(next_conn);
+            next_conn = NULL;
+        }
+        if (next_conn) {
+            tag->fixed_file = true;
+            add_accept_direct(listenfd, tag, next_conn->pool_id);
+            return;
+        }
+    }
+
+    *client_len = sizeof(*client_addr);
+    add_accept(listenfd, (struct sockaddr *) client_addr, client_len, tag);
+}
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    int cpu;
+    int sq_cpu; /* where this worker's SQPOLL thread runs, or -1 */
+} worker_t;
+
+static unsigned file_cache_entries = FILE_CACHE_DEFAULT_ENTRIES;
+static size_t content_budget = FILE_CACHE_DEFAULT_BUDGET;
+static size_t content_max_file = FILE_CACHE_DEFAULT_MAX_FILE;
+
+/* bumped by SIGUSR1, every worker dumps its statistics once it notices */
+static volatile sig_atomic_t stats_generation;
+
+static void request_stats(int signo UNUSED)
+{
+    stats_generation++;
+}
+
+static void report_stats(worker_t *w)
+{
+    file_cache_stats_t fc;
+    file_cache_get_stats(&fc);
+
+    pool_stats_t pool;
+    memorypool_get_stats(&pool);
+    arena_stats_t arena;
+    arena_get_stats(&arena);
+
+    double ratio = fc.lookups ? 100.0 * fc.hits / fc.lookups : 0;
+    fprintf(stderr,
+            "worker %d: file cache %u/%u entries, %lu lookups, %lu hits "
+            "(%.1f%%), %lu evictions, %lu invalidations\n"
+            "worker %d: content cache %zu/%zu bytes, %lu evictions\n"
+            "worker %d: request pool %u/%u objects, high water %u\n"
+            "worker %d: request arena high water %zu/%d bytes, %lu spills\n",
+            w->id, fc.entries, fc.capacity, (unsigned long) fc.lookups,
+            (unsigned long) fc.hits, ratio, (unsigned long) fc.evictions,
+            (unsigned long) fc.invalidations, w->id, fc.content_bytes,
+            fc.content_budget, (unsigned long) fc.content_evictions, w->id,
+            pool.in_use, pool.capacity, pool.high_water, w->id,
+            arena.high_water, ARENA_INLINE_LEN, (unsigned long) arena.spills);
+
+    proxy_stats_t up;
+    for (int i = 0; proxy_get_stats(i, &up) == 0; i++)
+        fprintf(stderr,
+                "worker %d: upstream %s -> %s %s, %u idle, %u busy, %lu "
+                "requests, %lu connects, %lu failures\n",
+                w->id, up.prefix, up.upstream, up.down ? "down" : "up",
+                up.idle, up.busy, (unsigned long) up.requests,
+                (unsigned long) up.connects, (unsigned long) up.failures);
+}
+
+static void *worker_loop(void *arg)
+{
+    worker_t *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(w->cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+
     int listenfd = open_listenfd(PORT);
+    if (listenfd < 0) {
+        log_err("worker %d: open_listenfd", w->id);
+        exit(1);
+    }
+    metrics_attach(w->id);
     init_memorypool();
-    init_io_uring();
+    ring_params_t rp = ring_params;
+    rp.sq_cpu = w->sq_cpu;
+    init_io_uring(use_direct, &rp);
     struct io_uring *ring = get_ring();
+    proxy_init();
+
+    /* without inotify nothing is cached, but everything is still served */
+    size_t ino_len = 0;
+    void *ino_buf = NULL;
+    if (file_cache_init(WEBROOT, file_cache_entries, content_budget,
+                        content_max_file) == 0) {
+        ino_buf = file_cache_event_buf(&ino_len);
+        add_inotify_read(file_cache_inotify_fd(), ino_buf, ino_len,
+                         get_request());
+    }
+    sig_atomic_t seen_generation = stats_generation;
+
+    http_clock_tick();
+    add_clock_timer(get_request());
+
+    timer_init();
+    add_tick_timer(get_request());
+    INIT_LIST_HEAD(&starved);
 
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
 
-    http_request_t *req = get_request();
-    add_accept(ring, listenfd, (struct sockaddr *) &client_addr, &client_len,
-               req);
-
-    printf("Web server started.\n");
+    multishot_accept = multishot_recv = use_multishot;
+    arm_accept(listenfd, get_request(), &client_addr, &client_len);
 
     while (1) {
         submit_and_wait();
@@ -81,52 +586,327 @@ int main()
         io_uring_for_each_cqe(ring, head, cqe)
         {
             ++count;
-            http_request_t *cqe_req = io_uring_cqe_get_data(cqe);
-            int type = cqe_req->event_type;
+            http_request_t *cqe_req = event_request(cqe->user_data);
+            int type = event_type(cqe->user_data);
 
             if (type == accept) {
-                add_accept(ring, listenfd, (struct sockaddr *) &client_addr,
-                           &client_len, cqe_req);
-
-                int clientfd = cqe->res;
-                if (clientfd >= 0) {
-                    http_request_t *request = get_request();
-                    init_http_request(request, clientfd, WEBROOT);
-                    add_read_request(request);
+                int res = cqe->res;
+                bool direct = cqe_req->fixed_file;
+                bool more =
+                    multishot_accept && (cqe->flags & IORING_CQE_F_MORE);
+                if (multishot_accept && res == -EINVAL) {
+                    /* kernel predates multishot accept */
+                    multishot_accept = multishot_recv = false;
                 }
-            } else if (type == read) {
-                int read_bytes = cqe->res;
-                if (read_bytes <= 0) {
-                    int ret = http_close_conn(cqe_req);
-                    assert(ret == 0 && "http_close_conn");
-                } else {
-                    cqe_req->bid = (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
-                    do_request(cqe_req, read_bytes);
+
+                /* plain: res is the descriptor; direct: the slot, or 0 when
+                 * the slot was picked by us
+                 */
+                if (res >= 0) {
+                    http_request_t *request;
+                    METRICS_INC(accepts);
+                    int fd = res;
+                    if (direct && !multishot_accept) {
+                        request = next_conn;
+                        next_conn = NULL;
+                        fd = request->pool_id;
+                    } else {
+                        request = get_request();
+                    }
+
+                    if (!request) {
+                        METRICS_INC(accept_drops);
+                        if (direct)
+                            add_close_direct(fd);
+                        else
+                            close(fd);
+                    } else {
+                        init_http_request(request, fd, WEBROOT);
+                        request->fixed_file = direct;
+                        timer_arm(&request->timer, TIMER_HEADER);
+                        PROBE2(accepted, request, fd);
+                        if (multishot_recv)
+                            add_multishot_read(request);
+                        else
+                            add_read_request(request);
+                    }
                 }
+
+                if (!more)
+                    arm_accept(listenfd, cqe_req, &client_addr, &client_len);
+            } else if (type == read) {
+                on_read(cqe_req, cqe);
             } else if (type == write) {
-                add_provide_buf(cqe_req->bid);
                 int write_bytes = cqe->res;
+                if (write_bytes > 0) {
+                    METRICS_INC(sends);
+                    METRICS_ADD(send_bytes, write_bytes);
+                }
                 if (write_bytes <= 0) {
-                    int ret = http_close_conn(cqe_req);
-                    assert(ret == 0 && "http_close_conn");
+                    on_response_error(cqe_req);
+                } else if (http_send_advance(cqe_req, write_bytes)) {
+                    timer_arm(&cqe_req->timer, TIMER_WRITE);
+                    add_send_request(cqe_req); /* short send */
+                } else {
+                    if (http_body_pending(cqe_req)) {
+                        /* nothing left to parse, let it go during the body */
+                        if (!http_input_pending(cqe_req))
+                            release_input(cqe_req);
+                        timer_arm(&cqe_req->timer, TIMER_WRITE);
+                        add_splice_request(cqe_req);
+                    } else {
+                        finish_body(cqe_req);
+                    }
+                }
+            } else if (type == splice_in) {
+                int in_bytes = cqe->res;
+                if (in_bytes == 0 && proxy_until_eof(cqe_req)) {
+                    /* the upstream closed, that is where the body ends */
+                    cqe_req->file_left = 0;
+                    finish_body(cqe_req);
+                } else if (in_bytes <= 0) {
+                    /* read error, or the file shrank under us */
+                    on_response_error(cqe_req);
                 } else {
-                    if (cqe_req->keep_alive == false)
-                        http_close_conn(cqe_req);
-                    else
-                        add_read_request(cqe_req);
+                    cqe_req->file_off += in_bytes;
+                    cqe_req->file_left -= in_bytes;
+                    cqe_req->pipe_len = in_bytes;
+                    add_splice_request(cqe_req);
                 }
+            } else if (type == splice_out) {
+                int out_bytes = cqe->res;
+                if (out_bytes <= 0) {
+                    on_response_error(cqe_req);
+                } else {
+                    METRICS_ADD(send_bytes, out_bytes);
+                    cqe_req->pipe_len -= out_bytes;
+                    if (http_body_pending(cqe_req)) {
+                        timer_arm(&cqe_req->timer, TIMER_WRITE);
+                        add_splice_request(cqe_req);
+                    } else {
+                        finish_body(cqe_req);
+                    }
+                }
+            } else if (type == inotify) {
+                if (cqe->res > 0)
+                    file_cache_handle_events(cqe->res);
+                if (cqe->res > 0 || cqe->res == -EINTR)
+                    add_inotify_read(file_cache_inotify_fd(), ino_buf,
+                                     ino_len, cqe_req);
+                else
+                    free_request(cqe_req);
+            } else if (type == clock_tick) {
+                pool_stats_t pool;
+                memorypool_get_stats(&pool);
+                metrics_set(&metrics->pool_in_use, pool.in_use);
+                metrics_set(&metrics->pool_capacity, pool.capacity);
+                http_clock_tick();
+                add_clock_timer(cqe_req);
+            } else if (type == upstream_connect || type == upstream_send ||
+                       type == upstream_recv) {
+                on_upstream(cqe_req, type, cqe->res);
+            } else if (type == detached) {
+                /* close or shutdown nobody waits for */
             } else if (type == prov_buf) {
                 free_request(cqe_req);
             } else if (type == uring_timer) {
-                free_request(cqe_req);
+                timer_tick(on_expire);
+                add_tick_timer(cqe_req);
             }
             if (count > 4096) {
                 break;
             }
         }
         uring_cq_advance(count);
+        wake_starved();
+
+        if (seen_generation != stats_generation) {
+            seen_generation = stats_generation;
+            report_stats(w);
+        }
     }
     uring_queue_exit();
 
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-e engine] [-D] [-c entries] [-m MiB] "
+            "[-s KiB]\n"
+            "       [-r msec] [-k msec] [-w msec] [-p profile] "
+            "[-P prefix=upstream]\n"
+            "  -t  number of worker threads, each with its own io_uring and\n"
+            "      SO_REUSEPORT listener (default: number of online CPUs)\n"
+            "  -e  oneshot: re-arm accept and recv after every completion\n"
+            "      multishot: keep multishot accept and recv armed\n"
+            "      (default: oneshot)\n"
+            "  -D  use plain descriptors instead of the registered file\n"
+            "      table for client sockets\n"
+            "  -c  open file cache entries per worker (default: %d)\n"
+            "  -m  memory for cached responses per worker (default: %d)\n"
+            "  -s  largest file kept in memory (default: %d)\n"
+            "  -r  time a client has to send a request (default: %d)\n"
+            "  -k  time a kept-alive connection may sit idle (default: %d)\n"
+            "  -w  time a response may go without progress (default: %d)\n"
+            "  -p  io_uring setup: default, coop (COOP_TASKRUN), defer\n"
+            "      (SINGLE_ISSUER and DEFER_TASKRUN) or sqpoll[:cpu[:msec]],\n"
+            "      whose pollers run from that CPU on, one per worker, and\n"
+            "      sleep after msec idle (default: unpinned, %d)\n"
+            "  -P  forward requests whose path starts with prefix to an\n"
+            "      upstream, host:port or unix:path, over kept-alive\n"
+            "      connections; may be given up to %d times\n"
+            "Send SIGUSR1 to dump per-worker cache statistics; sehttpd-stat\n"
+            "reads live counters from shared memory.\n",
+            prog, FILE_CACHE_DEFAULT_ENTRIES, FILE_CACHE_DEFAULT_BUDGET >> 20,
+            FILE_CACHE_DEFAULT_MAX_FILE >> 10, TIMER_DEFAULT_HEADER_MSEC,
+            TIMER_DEFAULT_IDLE_MSEC, TIMER_DEFAULT_WRITE_MSEC,
+            SQPOLL_DEFAULT_IDLE_MSEC, PROXY_MAX_ROUTES);
+}
+
+/* -p name[:cpu[:msec]]; only sqpoll takes the poller settings */
+static int parse_ring_profile(char *arg)
+{
+    char *cpu = strchr(arg, ':'), *idle = NULL;
+    if (cpu) {
+        *cpu++ = '\0';
+        idle = strchr(cpu, ':');
+        if (idle)
+            *idle++ = '\0';
+    }
+
+    int i;
+    for (i = RING_DEFAULT; i <= RING_DEFER; i++) {
+        if (!strcmp(arg, ring_profile_names[i]))
+            break;
+    }
+    if (i > RING_DEFER || (cpu && i != RING_SQPOLL))
+        return -1;
+    ring_params.profile = i;
+
+    char *end;
+    if (cpu && *cpu) {
+        ring_params.sq_cpu = strtol(cpu, &end, 10);
+        if (*end || ring_params.sq_cpu < 0)
+            return -1;
+    }
+    if (idle) {
+        long msec = strtol(idle, &end, 10);
+        if (*end || msec < 1)
+            return -1;
+        ring_params.sq_idle = msec;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    int nworkers = ncpus;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:e:Dc:m:s:r:k:w:p:P:h")) != -1) {
+        switch (opt) {
+        case 't':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (!strcmp(optarg, "multishot")) {
+                use_multishot = true;
+            } else if (!strcmp(optarg, "oneshot")) {
+                use_multishot = false;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'D':
+            use_direct = false;
+            break;
+        case 'c':
+            if (atoi(optarg) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            file_cache_entries = atoi(optarg);
+            break;
+        case 'm':
+        case 's':
+            if (atoi(optarg) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (opt == 'm')
+                content_budget = (size_t) atoi(optarg) << 20;
+            else
+                content_max_file = (size_t) atoi(optarg) << 10;
+            break;
+        case 'r':
+        case 'k':
+        case 'w':
+            if (atoi(optarg) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            timer_set_timeout(opt == 'r'   ? TIMER_HEADER
+                              : opt == 'k' ? TIMER_IDLE
+                                           : TIMER_WRITE,
+                              atoi(optarg));
+            break;
+        case 'p':
+            if (parse_ring_profile(optarg) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'P':
+            if (proxy_add_route(optarg) < 0) {
+                fprintf(stderr, "%s: bad route %s\n", argv[0], optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGUSR1, request_stats);
+    http_init();
+    if (metrics_init(nworkers) < 0) {
+        log_err("metrics_init");
+        exit(1);
+    }
+
+    worker_t *workers = calloc(nworkers, sizeof(worker_t));
+    assert(workers && "calloc workers");
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        /* only pin when there is at most one worker per core */
+        workers[i].cpu = (nworkers <= ncpus) ? i : -1;
+        workers[i].sq_cpu =
+            ring_params.sq_cpu >= 0 ? (ring_params.sq_cpu + i) % ncpus : -1;
+        if (pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i])) {
+            log_err("pthread_create");
+            exit(1);
+        }
+    }
+
+    printf("Web server started with %d worker(s), %s rings.\n", nworkers,
+           ring_profile_names[ring_params.profile]);
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i].tid, NULL);
+    free(workers);
+
     return 0;
 }
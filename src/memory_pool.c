@@ -1,49 +1,72 @@
 #include "memory_pool.h"
 
-#define Queue_Depth 8192
-#define PoolLength Queue_Depth
-#define BitmapSize PoolLength / 32
-uint32_t bitmap[BitmapSize];
-http_request_t *pool_ptr;
+#define SlabLength 1024
+#define MaxSlabs (POOL_MAX_OBJECTS / SlabLength)
+
+/* One pool per worker thread. Free objects form an intrusive LIFO list, so
+ * get_request() and free_request() are O(1) however full the pool is, and
+ * the most recently freed (cache-hot) object is handed out first. The pool
+ * grows a slab at a time; objects never move, and pool_id stays dense so it
+ * can index the registered file table.
+ */
+static __thread http_request_t *slabs[MaxSlabs];
+static __thread int nr_slabs;
+static __thread http_request_t *free_list;
+static __thread unsigned in_use, high_water;
+
+static int grow_pool()
+{
+    if (nr_slabs == MaxSlabs)
+        return -1;
+
+    http_request_t *slab = calloc(SlabLength, sizeof(http_request_t));
+    if (!slab)
+        return -1;
+
+    /* thread the slab so that its first object is handed out first */
+    for (int i = SlabLength - 1; i >= 0; i--) {
+        slab[i].pool_id = nr_slabs * SlabLength + i;
+        slab[i].pool_next = free_list;
+        free_list = &slab[i];
+    }
+    slabs[nr_slabs++] = slab;
+    return 0;
+}
 
 int init_memorypool()
 {
-    pool_ptr = calloc(PoolLength, sizeof(http_request_t));
-    for (int i = 0; i < PoolLength; i++) {
-        if (!&pool_ptr[i]) {
-            printf("Memory %d calloc fail\n", i);
-            exit(1);
-        }
-        (&pool_ptr[i])->pool_id = i;
+    if (grow_pool() < 0) {
+        printf("Memory pool calloc fail\n");
+        exit(1);
     }
     return 0;
 }
 
 inline http_request_t *get_request()
 {
-    int pos;
-    uint32_t bitset;
-
-    for (int i = 0; i < BitmapSize; i++) {
-        bitset = bitmap[i];
-        if (!(bitset ^ 0xffffffff))
-            continue;
-
-        for (int k = 0; k < 32; k++) {
-            if (!((bitset >> k) & 0x1)) {
-                bitmap[i] ^= (0x1 << k);
-                pos = 32 * i + k;
-                return &pool_ptr[pos];
-            }
-        }
+    if (!free_list && grow_pool() < 0) {
+        printf("Over connect!\n");
+        return NULL;
     }
-    printf("Over connect!\n");
-    return NULL;
+
+    http_request_t *req = free_list;
+    free_list = req->pool_next;
+    if (++in_use > high_water)
+        high_water = in_use;
+    return req;
 }
 
 int free_request(http_request_t *req)
 {
-    int pos = req->pool_id;
-    bitmap[pos / 32] ^= (0x1 << (pos % 32));
+    req->pool_next = free_list;
+    free_list = req;
+    in_use--;
     return 0;
 }
+
+void memorypool_get_stats(pool_stats_t *stats)
+{
+    stats->in_use = in_use;
+    stats->capacity = nr_slabs * SlabLength;
+    stats->high_water = high_water;
+}
@@ -1,9 +1,23 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "http.h"
 
+/* upper bound for the per-worker pool; pool_id is always below it */
+#define POOL_MAX_OBJECTS 65536
+
+typedef struct {
+    unsigned in_use, capacity;
+    unsigned high_water; /* most objects ever in use at once */
+} pool_stats_t;
+
 int init_memorypool();
 http_request_t *get_request();
 int free_request(http_request_t *req);
+void memorypool_get_stats(pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,58 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+/* threads that never attach, e.g. benchmarks linking the HTTP code, count
+ * into this one
+ */
+static metrics_worker_t unattached;
+__thread metrics_worker_t *metrics = &unattached;
+
+static metrics_shm_t *shm;
+
+/* Map the segment that sehttpd-stat reads. Anything left over from an
+ * earlier run is replaced. Without shared memory the counters still work,
+ * nobody can see them.
+ */
+int metrics_init(int nr_workers)
+{
+    size_t len = sizeof(metrics_shm_t) + nr_workers * sizeof(metrics_worker_t);
+    void *p = MAP_FAILED;
+
+    shm_unlink(METRICS_SHM_NAME);
+    int fd = shm_open(METRICS_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, len) == 0)
+            p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (p == MAP_FAILED) {
+        log_err("metrics segment %s", METRICS_SHM_NAME);
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return -1;
+    }
+
+    shm = p;
+    memset(shm, 0, len);
+    shm->version = METRICS_VERSION;
+    shm->nr_workers = nr_workers;
+    shm->pid = getpid();
+    shm->started = time(NULL);
+    /* readers check the magic last */
+    __atomic_store_n(&shm->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void metrics_attach(int worker)
+{
+    if (shm)
+        metrics = &shm->workers[worker];
+}
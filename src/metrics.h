@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_SHM_NAME "/sehttpd"
+#define METRICS_MAGIC 0x73656874 /* "seht" */
+#define METRICS_VERSION 4
+#define METRICS_LATENCY_BUCKETS 32 /* bucket i: [2^i, 2^(i+1)) usec */
+
+/* Counters of one worker. Only the worker writes them, one whole 64-bit
+ * store at a time, so a reader in another process never sees a torn value;
+ * it does not get a consistent snapshot across counters either.
+ */
+typedef struct {
+    uint64_t accepts;
+    uint64_t accept_drops; /* no request object left */
+    uint64_t recvs, recv_bytes;
+    uint64_t buf_starved; /* recv found no provided buffer */
+    uint64_t sends, send_bytes;
+    uint64_t enters; /* io_uring_enter() calls */
+    uint64_t sqes;   /* ... and the SQEs they submitted */
+    uint64_t timeouts;
+    uint64_t upstream_requests, upstream_connects, upstream_failures;
+    uint64_t responses[6]; /* by status class, 1xx to 5xx */
+    uint64_t pool_in_use, pool_capacity; /* refreshed every second */
+    uint64_t latency[METRICS_LATENCY_BUCKETS];
+} __attribute__((aligned(64))) metrics_worker_t;
+
+/* The shared segment: a header, then one block per worker. */
+typedef struct {
+    uint32_t magic, version;
+    uint32_t nr_workers;
+    int32_t pid;
+    uint64_t started; /* wall clock, in seconds */
+    metrics_worker_t workers[];
+} metrics_shm_t;
+
+/* the calling worker's block; a private one until metrics_attach() */
+extern __thread metrics_worker_t *metrics;
+
+int metrics_init(int nr_workers);
+void metrics_attach(int worker);
+
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+#define METRICS_INC(field) metrics_add(&metrics->field, 1)
+#define METRICS_ADD(field, n) metrics_add(&metrics->field, n)
+
+static inline void metrics_set(uint64_t *gauge, uint64_t v)
+{
+    __atomic_store_n(gauge, v, __ATOMIC_RELAXED);
+}
+
+static inline int metrics_latency_bucket(uint64_t usec)
+{
+    int b = 63 - __builtin_clzll(usec | 1);
+    return b < METRICS_LATENCY_BUCKETS ? b : METRICS_LATENCY_BUCKETS - 1;
+}
+
+/* @n responses that took @usec each */
+static inline void metrics_latency(uint64_t usec, int n)
+{
+    metrics_add(&metrics->latency[metrics_latency_bucket(usec)], n);
+}
+
+static inline void metrics_status(int status)
+{
+    int c = status / 100;
+    if (c >= 1 && c <= 5)
+        metrics_add(&metrics->responses[c], 1);
+}
+
+#endif
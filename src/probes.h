@@ -0,0 +1,41 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes of the "sehttpd" provider; ebpf/ has the scripts using them.
+ * With <sys/sdt.h> from SystemTap every probe is a single nop plus an ELF
+ * note, which a tracer turns into a breakpoint while it is attached. The
+ * arguments are registers or stack slots that are live anyway. Without
+ * the header, or built with -DNO_PROBES, the probes compile away.
+ *
+ * The first argument is always the connection (its http_request_t).
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) STAP_PROBE1(sehttpd, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(sehttpd, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(sehttpd, name, a, b, c)
+#else
+#define PROBE1(name, a) \
+    do {                \
+        (void) (a);     \
+    } while (0)
+#define PROBE2(name, a, b) \
+    do {                   \
+        (void) (a);        \
+        (void) (b);        \
+    } while (0)
+#define PROBE3(name, a, b, c) \
+    do {                      \
+        (void) (a);           \
+        (void) (b);           \
+        (void) (c);           \
+    } while (0)
+#endif
+
+#endif
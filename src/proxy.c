@@ -0,0 +1,758 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of memmem(3) */
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_header_hash.h"
+#include "logger.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "uring.h"
+
+/* Requests under a prefix go to an upstream instead of the webroot. The
+ * routes are set up once; every worker keeps its own connections to each
+ * upstream, driven by its own ring like the client connections are.
+ */
+typedef struct {
+    char prefix[PROXY_PREFIX_LEN];
+    size_t prefix_len;
+    char upstream[PROXY_PREFIX_LEN]; /* as given, for the statistics */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} route_t;
+
+static route_t routes[PROXY_MAX_ROUTES];
+static int nr_routes;
+
+/* The kept-alive connections of a route, most recently used first, and
+ * its health: after PROXY_MAX_FAILS failures in a row no connection is
+ * tried for PROXY_DOWN_MSEC, the next request after that probes it.
+ */
+typedef struct {
+    struct list_head idle;
+    unsigned nr_idle, nr_busy;
+    unsigned fails;
+    uint64_t down_until; /* msec */
+    uint64_t requests, connects, failures;
+} pool_t;
+
+static __thread pool_t pools[PROXY_MAX_ROUTES];
+
+/* where scan_chunks() is in a chunked body */
+enum {
+    CH_SIZE = 0,
+    CH_EXT,      /* extensions, up to the end of the size line */
+    CH_DATA,
+    CH_DATA_END, /* the CRLF after the data */
+    CH_TRAILER,  /* at the start of a trailer line */
+    CH_TRAILER_LINE,
+    CH_DONE,
+};
+
+static uint64_t monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static inline char *append(char *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+    return dst + len;
+}
+
+/* "prefix=host:port", "prefix=[v6addr]:port" or "prefix=unix:path" */
+int proxy_add_route(const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (nr_routes == PROXY_MAX_ROUTES || spec[0] != '/' || !eq ||
+        eq - spec >= PROXY_PREFIX_LEN || strlen(eq + 1) >= PROXY_PREFIX_LEN)
+        return -1;
+
+    route_t *rt = &routes[nr_routes];
+    const char *up = eq + 1;
+    memset(rt, 0, sizeof(*rt));
+    rt->prefix_len = eq - spec;
+    memcpy(rt->prefix, spec, rt->prefix_len);
+    strcpy(rt->upstream, up);
+
+    if (!strncmp(up, "unix:", 5)) {
+        struct sockaddr_un *sun = (struct sockaddr_un *) &rt->addr;
+        if (!up[5] || strlen(up + 5) >= sizeof(sun->sun_path))
+            return -1;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, up + 5);
+        rt->addr_len = sizeof(*sun);
+    } else {
+        char host[PROXY_PREFIX_LEN];
+        const char *colon = strrchr(up, ':');
+        if (!colon || colon == up || !colon[1])
+            return -1;
+        size_t len = colon - up;
+        if (up[0] == '[' && up[len - 1] == ']') {
+            up++;
+            len -= 2;
+        }
+        memcpy(host, up, len);
+        host[len] = '\0';
+
+        struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *ai;
+        if (getaddrinfo(host, colon + 1, &hints, &ai))
+            return -1;
+        memcpy(&rt->addr, ai->ai_addr, ai->ai_addrlen);
+        rt->addr_len = ai->ai_addrlen;
+        freeaddrinfo(ai);
+    }
+    nr_routes++;
+    return 0;
+}
+
+void proxy_init()
+{
+    for (int i = 0; i < nr_routes; i++) {
+        memset(&pools[i], 0, sizeof(pools[i]));
+        INIT_LIST_HEAD(&pools[i].idle);
+    }
+}
+
+/* The route with the longest prefix of @uri, or -1 to serve a file. */
+int proxy_route(const char *uri, size_t len)
+{
+    int best = -1;
+    for (int i = 0; i < nr_routes; i++) {
+        if (routes[i].prefix_len <= len &&
+            !memcmp(uri, routes[i].prefix, routes[i].prefix_len) &&
+            (best < 0 || routes[i].prefix_len > routes[best].prefix_len))
+            best = i;
+    }
+    return best;
+}
+
+/* A request body is forwarded along with the header, so all of it has to
+ * arrive first and fit where a partial request is kept. Returns its
+ * length, or minus the status to answer with.
+ */
+int proxy_body_len(http_request_t *r)
+{
+    size_t limit = HTTP_MAX_HEADER - (r->pos - r->req_off);
+    int len = 0;
+    list_head *pos;
+
+    list_for_each (pos, &r->list) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        enum http_header_id id = http_header_lookup(
+            hd->key_start, hd->key_end - hd->key_start);
+        if (id == HTTP_HDR_TRANSFER_ENCODING)
+            return -HTTP_LENGTH_REQUIRED;
+        if (id != HTTP_HDR_CONTENT_LENGTH)
+            continue;
+
+        const char *p = hd->value_start, *end = hd->value_end;
+        if (p == end)
+            return -HTTP_BAD_REQUEST;
+        for (len = 0; p < end; p++) {
+            if (*p < '0' || *p > '9')
+                return -HTTP_BAD_REQUEST;
+            len = len * 10 + (*p - '0');
+            if ((size_t) len > limit)
+                return -HTTP_CONTENT_TOO_LARGE;
+        }
+    }
+    return len;
+}
+
+static void drop_idle(pool_t *p)
+{
+    while (p->nr_idle) {
+        proxy_conn_t *c = list_entry(p->idle.next, proxy_conn_t, idle);
+        list_del(&c->idle);
+        p->nr_idle--;
+        close(c->fd);
+        free(c);
+    }
+}
+
+static void upstream_failed(int route)
+{
+    pool_t *p = &pools[route];
+    p->failures++;
+    METRICS_INC(upstream_failures);
+    if (++p->fails >= PROXY_MAX_FAILS) {
+        p->down_until = monotonic_msec() + PROXY_DOWN_MSEC;
+        drop_idle(p); /* as dead as the upstream, most likely */
+    }
+}
+
+/* Forward the request with the hop-by-hop headers taken out; see
+ * proxy_body_len() for the body. As received the request takes up at most
+ * HTTP_MAX_HEADER bytes, rewritten it grows by a few bytes per header at
+ * worst, which buf has room for.
+ */
+static size_t render_request(http_request_t *r, proxy_conn_t *c)
+{
+    bool http10 = r->http_major == 1 && r->http_minor == 0;
+    const char *method = r->request_start;
+    char *p = c->buf;
+
+    c->head = (char *) r->uri_start - method > 4 && !memcmp(method, "HEAD ", 5);
+    p = append(p, method, (char *) r->uri_end - method);
+    p = http10 ? append(p, " HTTP/1.0\r\n", 11) : append(p, " HTTP/1.1\r\n", 11);
+
+    /* the parser prepends, so the original order is backwards */
+    for (list_head *pos = r->list.prev; pos != &r->list; pos = pos->prev) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        size_t key_len = (char *) hd->key_end - (char *) hd->key_start;
+        switch (http_header_lookup(hd->key_start, key_len)) {
+        case HTTP_HDR_CONNECTION:
+        case HTTP_HDR_KEEP_ALIVE:
+        case HTTP_HDR_UPGRADE:
+        case HTTP_HDR_EXPECT: /* the body is here already */
+            continue;
+        default:
+            break;
+        }
+        p = append(p, hd->key_start, key_len);
+        p = append(p, ": ", 2);
+        p = append(p, hd->value_start,
+                   (char *) hd->value_end - (char *) hd->value_start);
+        p = append(p, "\r\n", 2);
+    }
+    /* HTTP/1.0 has to ask for a persistent connection, and gets no chunked
+     * response the client could not take either
+     */
+    if (http10)
+        p = append(p, "Connection: keep-alive\r\n", 24);
+    p = append(p, "\r\n", 2);
+    p = append(p, r->buf + r->pos, r->body_len);
+    return p - c->buf;
+}
+
+/* Take a connection for the request at r->pos, whose body is complete, and
+ * set the request aside until the responses queued ahead of it are out,
+ * see proxy_continue(). Returns 0, or the status to answer with instead.
+ */
+int proxy_queue(http_request_t *r, http_out_t *out)
+{
+    pool_t *p = &pools[r->route];
+    proxy_conn_t *c;
+
+    if (p->fails >= PROXY_MAX_FAILS && monotonic_msec() < p->down_until)
+        return HTTP_SERVICE_UNAVAILABLE;
+
+    if (p->nr_idle) {
+        c = list_entry(p->idle.next, proxy_conn_t, idle);
+        list_del(&c->idle);
+        p->nr_idle--;
+        c->reused = true;
+    } else {
+        c = malloc(sizeof(proxy_conn_t));
+        if (!c)
+            return HTTP_INTERNAL_ERROR;
+        c->fd = -1;
+        c->route = r->route;
+        c->reused = false;
+    }
+
+    c->req_len = render_request(r, c);
+    c->req_sent = 0;
+    c->len = 0;
+    c->aborted = false;
+    c->state = PROXY_QUEUED;
+    http_handle_connection(r, out);
+
+    p->nr_busy++;
+    p->requests++;
+    METRICS_INC(upstream_requests);
+    r->upstream = c;
+    return 0;
+}
+
+static void send_request(http_request_t *r, proxy_conn_t *c)
+{
+    c->state = PROXY_SENDING;
+    add_upstream_send(c->fd, c->buf + c->req_sent, c->req_len - c->req_sent,
+                      r);
+}
+
+/* Nothing came from the upstream: count it against the route, and the
+ * client gets a 502.
+ */
+static void fail(http_request_t *r, proxy_conn_t *c)
+{
+    upstream_failed(c->route);
+    c->state = PROXY_FAILED;
+    http_send_error(r, HTTP_BAD_GATEWAY);
+}
+
+static void connect_upstream(http_request_t *r, proxy_conn_t *c)
+{
+    const route_t *rt = &routes[c->route];
+    int one = 1;
+
+    c->fd = socket(rt->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        log_err("socket");
+        fail(r, c);
+        return;
+    }
+    if (rt->addr.ss_family != AF_UNIX)
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pools[c->route].connects++;
+    METRICS_INC(upstream_connects);
+    c->state = PROXY_CONNECTING;
+    add_connect(c->fd, (struct sockaddr *) &rt->addr, rt->addr_len,
+                PROXY_CONNECT_MSEC, r);
+}
+
+/* A kept-alive connection may have been closed by the upstream while it
+ * sat in the pool; a request that is safe to repeat then goes out again on
+ * a fresh one, provided no byte of the response came back.
+ */
+static void retry_or_fail(http_request_t *r, proxy_conn_t *c)
+{
+    if (!c->reused || c->len > 0 || (r->method != HTTP_GET && !c->head)) {
+        fail(r, c);
+        return;
+    }
+    close(c->fd);
+    c->reused = false;
+    c->req_sent = 0;
+    connect_upstream(r, c);
+}
+
+static inline int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch |= 0x20;
+    return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+/* Follow the chunked framing through @len bytes at @p. Returns how many of
+ * them belong to the body, all of them unless it ends in between, or -1
+ * if the framing is broken.
+ */
+static ssize_t scan_chunks(proxy_conn_t *c, const char *p, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && c->chunk_state != CH_DONE) {
+        char ch = p[i];
+        int d;
+        switch (c->chunk_state) {
+        case CH_SIZE:
+            if ((d = hex_digit(ch)) >= 0) {
+                if (c->chunk_left > (SIZE_MAX >> 5))
+                    return -1;
+                c->chunk_left = c->chunk_left * 16 + d;
+                c->chunk_sized = true;
+            } else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+                c->chunk_state = CH_EXT;
+            } else if (ch == '\n') {
+                if (!c->chunk_sized)
+                    return -1;
+                c->chunk_state = c->chunk_left ? CH_DATA : CH_TRAILER;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+        case CH_EXT:
+            if (ch == '\n') {
+                if (!c->chunk_sized)
+                    return -1;
+                c->chunk_state = c->chunk_left ? CH_DATA : CH_TRAILER;
+            }
+            i++;
+            break;
+        case CH_DATA: {
+            size_t n = len - i < c->chunk_left ? len - i : c->chunk_left;
+            i += n;
+            c->chunk_left -= n;
+            if (!c->chunk_left)
+                c->chunk_state = CH_DATA_END;
+            break;
+        }
+        case CH_DATA_END:
+            if (ch == '\n') {
+                c->chunk_state = CH_SIZE;
+                c->chunk_sized = false;
+            } else if (ch != '\r') {
+                return -1;
+            }
+            i++;
+            break;
+        case CH_TRAILER:
+            if (ch == '\n')
+                c->chunk_state = CH_DONE;
+            else if (ch != '\r')
+                c->chunk_state = CH_TRAILER_LINE;
+            i++;
+            break;
+        case CH_TRAILER_LINE:
+            if (ch == '\n')
+                c->chunk_state = CH_TRAILER;
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+static bool body_complete(const proxy_conn_t *c)
+{
+    if (c->chunked)
+        return c->chunk_state == CH_DONE;
+    return !c->until_eof && !c->body_left;
+}
+
+/* Pass the response header on with the hop-by-hop fields replaced by our
+ * own Connection, along with the part of the body that came with it. The
+ * rest follows by splice when it is long or delimited by the upstream
+ * closing, through buf otherwise; a chunked body always goes through buf,
+ * as its framing has to be followed to know where it ends.
+ */
+static void respond(http_request_t *r, proxy_conn_t *c, size_t hdr_len)
+{
+    char *hdr = arena_alloc(&r->arena, hdr_len + 64);
+    const char *line = c->buf, *end = c->buf + hdr_len - 2;
+    long long content_length = -1;
+
+    if (!hdr) {
+        fail(r, c);
+        return;
+    }
+    int status = atoi(c->buf + 9);
+    c->keep_alive = c->buf[7] == '1' && (r->http_major > 1 || r->http_minor);
+    c->chunked = c->until_eof = false;
+
+    /* the version is ours, the rest of the status line the upstream's */
+    char *eol = memchr(line, '\n', end - line);
+    char *p = append(hdr, "HTTP/1.1", 8);
+    p = append(p, line + 8, eol + 1 - (line + 8));
+    for (line = eol + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        const char *colon = memchr(line, ':', eol - line);
+        const char *v = colon ? colon + 1 : eol, *v_end = eol;
+        while (v < v_end && (*v == ' ' || *v == '\t'))
+            v++;
+        while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' '))
+            v_end--;
+
+        switch (colon ? http_header_lookup(line, colon - line)
+                      : HTTP_HDR_UNKNOWN) {
+        case HTTP_HDR_CONNECTION:
+            if (v_end - v == 5 && !strncasecmp(v, "close", 5))
+                c->keep_alive = false;
+            else if (v_end - v == 10 && !strncasecmp(v, "keep-alive", 10))
+                c->keep_alive = true;
+            continue;
+        case HTTP_HDR_KEEP_ALIVE:
+            continue;
+        case HTTP_HDR_CONTENT_LENGTH:
+            content_length = 0;
+            for (; v < v_end && *v >= '0' && *v <= '9'; v++) {
+                if (content_length > (LLONG_MAX - 9) / 10)
+                    break;
+                content_length = content_length * 10 + (*v - '0');
+            }
+            if (v != v_end) {
+                fail(r, c);
+                return;
+            }
+            break;
+        case HTTP_HDR_TRANSFER_ENCODING:
+            c->chunked = v_end - v >= 7 && !strncasecmp(v_end - 7, "chunked", 7);
+            if (!c->chunked) { /* some other coding, ends with the connection */
+                fail(r, c);
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+        p = append(p, line, eol + 1 - line);
+    }
+    if (c->chunked && content_length >= 0) { /* a smuggling attempt */
+        fail(r, c);
+        return;
+    }
+
+    /* framing, see RFC 9112 section 6.3 */
+    char *body = c->buf + hdr_len;
+    size_t avail = c->len - hdr_len, n = avail;
+    c->body_left = 0;
+    if (c->head || status == 204 || status == 304) {
+        n = 0;
+    } else if (c->chunked) {
+        c->chunk_state = CH_SIZE;
+        c->chunk_left = 0;
+        c->chunk_sized = false;
+        ssize_t s = scan_chunks(c, body, avail);
+        if (s < 0) {
+            fail(r, c);
+            return;
+        }
+        n = s;
+    } else if (content_length >= 0) {
+        n = (size_t) content_length < avail ? (size_t) content_length : avail;
+        c->body_left = content_length - n;
+    } else {
+        c->until_eof = true;
+        c->keep_alive = false;
+        r->keep_alive = false; /* nothing else tells the client where it ends */
+    }
+    if (n < avail) /* more than the response, the connection is out of step */
+        c->keep_alive = false;
+
+    p = http_append_connection(p, r->keep_alive);
+    p = append(p, "\r\n", 2);
+    arena_trim(&r->arena, hdr, p - hdr);
+    metrics_status(status);
+
+    bool splice = !c->chunked && (c->until_eof || c->body_left > PROXY_BUF_LEN);
+    if (splice && r->pipefd[0] < 0 && pipe(r->pipefd) < 0) {
+        r->pipefd[0] = r->pipefd[1] = -1;
+        splice = false;
+    }
+    if (body_complete(c)) {
+        c->state = PROXY_DONE;
+    } else if (splice) {
+        c->state = PROXY_SPLICE;
+        r->file_left = c->until_eof ? SIZE_MAX : c->body_left;
+        r->pipe_len = 0;
+        c->body_left = 0;
+    } else {
+        c->state = PROXY_BODY;
+    }
+
+    r->iov[0].iov_base = hdr;
+    r->iov[0].iov_len = p - hdr;
+    r->iov[1].iov_base = body;
+    r->iov[1].iov_len = n;
+    r->iovcnt = n ? 2 : 1;
+    add_send_request(r);
+}
+
+static void on_header(http_request_t *r, proxy_conn_t *c, int res)
+{
+    if (res <= 0) {
+        retry_or_fail(r, c);
+        return;
+    }
+    c->len += res;
+
+    size_t hdr_len;
+    for (;;) {
+        char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+        if (!end) {
+            if (c->len == PROXY_BUF_LEN) /* too large for us */
+                fail(r, c);
+            else
+                add_upstream_recv(c->fd, c->buf + c->len,
+                                  PROXY_BUF_LEN - c->len, r);
+            return;
+        }
+
+        hdr_len = end + 4 - c->buf;
+        if (hdr_len < 13 || memcmp(c->buf, "HTTP/1.", 7) ||
+            c->buf[8] != ' ' || c->buf[9] < '1' || c->buf[9] > '5') {
+            fail(r, c);
+            return;
+        }
+        if (c->buf[9] != '1')
+            break;
+        if (!memcmp(c->buf + 9, "101", 3)) { /* we never ask to upgrade */
+            fail(r, c);
+            return;
+        }
+        /* an interim response, the final one follows */
+        memmove(c->buf, c->buf + hdr_len, c->len - hdr_len);
+        c->len -= hdr_len;
+    }
+
+    pools[c->route].fails = 0;
+    respond(r, c, hdr_len);
+}
+
+/* Returns 1 once the body is complete without anything to send. */
+static int on_body(http_request_t *r, proxy_conn_t *c, int res)
+{
+    if (res == 0 && c->until_eof) {
+        c->state = PROXY_DONE;
+        return 1;
+    }
+    if (res <= 0) { /* the client has a partial response, all we can do */
+        upstream_failed(c->route);
+        return -1;
+    }
+
+    size_t n = res;
+    if (c->chunked) {
+        ssize_t s = scan_chunks(c, c->buf, res);
+        if (s < 0) {
+            upstream_failed(c->route);
+            return -1;
+        }
+        n = s;
+        if (n < (size_t) res)
+            c->keep_alive = false;
+    } else if (!c->until_eof) {
+        c->body_left -= n; /* never asked for more */
+    }
+    if (body_complete(c))
+        c->state = PROXY_DONE;
+
+    r->iov[0].iov_base = c->buf;
+    r->iov[0].iov_len = n;
+    r->iovcnt = 1;
+    add_send_request(r);
+    return 0;
+}
+
+/* What was queued for the client is out: go on with the exchange. Returns
+ * false if there is nothing more to it, or no exchange at all.
+ */
+bool proxy_continue(http_request_t *r)
+{
+    proxy_conn_t *c = r->upstream;
+    if (!c)
+        return false;
+
+    switch (c->state) {
+    case PROXY_QUEUED:
+        if (c->fd >= 0)
+            send_request(r, c);
+        else
+            connect_upstream(r, c);
+        return true;
+    case PROXY_BODY: {
+        size_t want = PROXY_BUF_LEN;
+        if (!c->chunked && !c->until_eof && c->body_left < want)
+            want = c->body_left;
+        add_upstream_recv(c->fd, c->buf, want, r);
+        return true;
+    }
+    case PROXY_SPLICE:
+        c->state = PROXY_DONE;
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* An upstream operation completed with @res. Returns 0 if the exchange
+ * queued its next step, 1 if the response is complete and -1 if the
+ * client connection has to go, for it has part of a response at most.
+ */
+int proxy_complete(http_request_t *r, int type, int res)
+{
+    proxy_conn_t *c = r->upstream;
+
+    if (c->aborted)
+        return -1;
+
+    switch (type) {
+    case upstream_connect:
+        if (res < 0)
+            fail(r, c);
+        else
+            send_request(r, c);
+        return 0;
+    case upstream_send:
+        if (res <= 0) {
+            retry_or_fail(r, c);
+            return 0;
+        }
+        c->req_sent += res;
+        if (c->req_sent < c->req_len) {
+            send_request(r, c);
+            return 0;
+        }
+        c->state = PROXY_HEADER;
+        add_upstream_recv(c->fd, c->buf, PROXY_BUF_LEN, r);
+        return 0;
+    default:
+        if (c->state == PROXY_HEADER) {
+            on_header(r, c, res);
+            return 0;
+        }
+        return on_body(r, c, res);
+    }
+}
+
+/* the body is spliced until the upstream closes */
+bool proxy_until_eof(http_request_t *r)
+{
+    return r->upstream && r->upstream->until_eof;
+}
+
+/* The client ran out of time: wake what the exchange waits for on the
+ * upstream, the completion then ends it. A connect is bounded on its own.
+ */
+void proxy_abort(http_request_t *r)
+{
+    proxy_conn_t *c = r->upstream;
+    if (!c || c->fd < 0)
+        return;
+
+    if (c->state >= PROXY_SENDING && c->state <= PROXY_HEADER)
+        upstream_failed(c->route);
+    c->aborted = true;
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/* The response is through, or the client connection is closing: the
+ * connection goes back to the pool if both sides left it usable.
+ */
+void proxy_release(http_request_t *r)
+{
+    proxy_conn_t *c = r->upstream;
+    if (!c)
+        return;
+    r->upstream = NULL;
+
+    pool_t *p = &pools[c->route];
+    p->nr_busy--;
+    if (c->state == PROXY_DONE && c->keep_alive && !c->aborted &&
+        p->nr_idle < PROXY_MAX_IDLE && p->fails < PROXY_MAX_FAILS) {
+        list_add(&c->idle, &p->idle);
+        p->nr_idle++;
+        return;
+    }
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c);
+}
+
+int proxy_get_stats(int route, proxy_stats_t *stats)
+{
+    if (route >= nr_routes)
+        return -1;
+
+    const pool_t *p = &pools[route];
+    stats->prefix = routes[route].prefix;
+    stats->upstream = routes[route].upstream;
+    stats->down =
+        p->fails >= PROXY_MAX_FAILS && monotonic_msec() < p->down_until;
+    stats->idle = p->nr_idle;
+    stats->busy = p->nr_busy;
+    stats->requests = p->requests;
+    stats->connects = p->connects;
+    stats->failures = p->failures;
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "list.h"
+
+#define PROXY_MAX_ROUTES 8
+#define PROXY_PREFIX_LEN 128
+#define PROXY_MAX_IDLE 32 /* kept-alive upstream connections per route */
+#define PROXY_BUF_LEN 16384
+#define PROXY_CONNECT_MSEC 1000
+#define PROXY_MAX_FAILS 3    /* consecutive failures before a route is down */
+#define PROXY_DOWN_MSEC 5000 /* ... and how long it stays down */
+
+/* where an exchange with the upstream stands */
+enum proxy_state {
+    PROXY_QUEUED,     /* waits for the responses ahead of it to go out */
+    PROXY_CONNECTING,
+    PROXY_SENDING,
+    PROXY_HEADER,     /* receiving the response header */
+    PROXY_BODY,       /* relaying the body through buf */
+    PROXY_SPLICE,     /* ... or by splice, see add_splice_request() */
+    PROXY_DONE,
+    PROXY_FAILED,     /* the client got an error page instead */
+};
+
+/* One connection to an upstream. It serves one client request at a time
+ * and goes back to its route's pool once the response is through, unless
+ * either side said it would close.
+ */
+typedef struct proxy_conn {
+    int fd;
+    int route;
+    int state;        /* enum proxy_state */
+    bool reused;      /* came out of the pool, may have been closed since */
+    bool aborted;     /* the client timed out, see proxy_abort() */
+    bool head;        /* the response has no body whatever it says */
+    bool keep_alive;  /* the upstream keeps the connection open */
+    bool chunked;     /* body framing, when neither is set: body_left */
+    bool until_eof;
+    size_t body_left;
+    int chunk_state;  /* where scan_chunks() stopped */
+    size_t chunk_left;
+    bool chunk_sized; /* the size line has a digit */
+    size_t req_len, req_sent;
+    size_t len; /* bytes of the response in buf */
+    struct list_head idle;
+    char buf[PROXY_BUF_LEN]; /* the request, then the response */
+} proxy_conn_t;
+
+typedef struct {
+    const char *prefix, *upstream;
+    bool down;
+    unsigned idle, busy;
+    uint64_t requests, connects, failures;
+} proxy_stats_t;
+
+/* process wide, before the workers start */
+int proxy_add_route(const char *spec);
+
+void proxy_init();
+int proxy_route(const char *uri, size_t len);
+int proxy_body_len(http_request_t *r);
+int proxy_queue(http_request_t *r, http_out_t *out);
+bool proxy_continue(http_request_t *r);
+int proxy_complete(http_request_t *r, int type, int res);
+bool proxy_until_eof(http_request_t *r);
+void proxy_abort(http_request_t *r);
+void proxy_release(http_request_t *r);
+int proxy_get_stats(int route, proxy_stats_t *stats);
+
+#endif
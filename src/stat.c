@@ -0,0 +1,233 @@
+/* sehttpd-stat: read the counters of a running server from its shared
+ * memory segment. Without -i it prints the totals since start; with -i it
+ * prints what changed over every interval. The server is not involved in
+ * any of this, it only ever writes to its own memory.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define NR_FIELDS (sizeof(metrics_worker_t) / sizeof(uint64_t))
+
+static const metrics_shm_t *shm;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-i sec] [-n count] [-w]\n"
+            "  -i  print the change over every interval instead of totals\n"
+            "  -n  stop after that many intervals\n"
+            "  -w  one line per worker as well as the sum\n",
+            prog);
+}
+
+static int attach()
+{
+    int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open " METRICS_SHM_NAME);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(metrics_shm_t)) {
+        fprintf(stderr, "%s: not a metrics segment\n", METRICS_SHM_NAME);
+        close(fd);
+        return -1;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        shm->version != METRICS_VERSION ||
+        sizeof(metrics_shm_t) + shm->nr_workers * sizeof(metrics_worker_t) >
+            (size_t) st.st_size) {
+        fprintf(stderr, "%s: unknown layout\n", METRICS_SHM_NAME);
+        return -1;
+    }
+    if (kill(shm->pid, 0) < 0)
+        fprintf(stderr, "server %d is gone, showing its last counters\n",
+                shm->pid);
+    return 0;
+}
+
+/* every field is a counter except for the pool gauges */
+static bool is_gauge(size_t i)
+{
+    return i == offsetof(metrics_worker_t, pool_in_use) / sizeof(uint64_t) ||
+           i == offsetof(metrics_worker_t, pool_capacity) / sizeof(uint64_t);
+}
+
+static void snapshot(metrics_worker_t *dst, int worker)
+{
+    const uint64_t *src = (const uint64_t *) &shm->workers[worker];
+    uint64_t *d = (uint64_t *) dst;
+    for (size_t i = 0; i < NR_FIELDS; i++)
+        d[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void diff(metrics_worker_t *dst,
+                 const metrics_worker_t *now,
+                 const metrics_worker_t *then)
+{
+    const uint64_t *a = (const uint64_t *) now, *b = (const uint64_t *) then;
+    uint64_t *d = (uint64_t *) dst;
+    for (size_t i = 0; i < NR_FIELDS; i++)
+        d[i] = is_gauge(i) ? a[i] : a[i] - b[i];
+}
+
+static void sum(metrics_worker_t *dst, const metrics_worker_t *w)
+{
+    const uint64_t *a = (const uint64_t *) w;
+    uint64_t *d = (uint64_t *) dst;
+    for (size_t i = 0; i < NR_FIELDS; i++)
+        d[i] += a[i];
+}
+
+/* upper bound of the bucket holding the @p-th percentile, in usec */
+static uint64_t percentile(const metrics_worker_t *m, double p)
+{
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+        total += m->latency[i];
+    if (!total)
+        return 0;
+
+    uint64_t rank = total * p / 100;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        seen += m->latency[i];
+        if (seen > rank)
+            return 2ULL << i;
+    }
+    return 2ULL << (METRICS_LATENCY_BUCKETS - 1);
+}
+
+static void header()
+{
+    printf("%-6s %9s %9s %9s %9s %8s %7s %9s %7s %7s %7s %9s %8s %7s %11s "
+           "%7s %7s %9s %9s\n",
+           "worker", "accepts", "drops", "recvs", "sends", "timeouts",
+           "nobufs", "2xx", "3xx", "4xx", "5xx", "upstream", "connects",
+           "upfails", "pool", "p50", "p99", "enter/rsp", "sqe/enter");
+}
+
+static void line(const char *name, const metrics_worker_t *m, double secs)
+{
+    /* per second over an interval, plain totals otherwise */
+    double f = secs > 0 ? 1 / secs : 1;
+    char pool[24];
+    uint64_t responses = 0;
+
+    for (int i = 0; i < 6; i++)
+        responses += m->responses[i];
+
+    snprintf(pool, sizeof(pool), "%lu/%lu", (unsigned long) m->pool_in_use,
+             (unsigned long) m->pool_capacity);
+    printf("%-6s %9.0f %9.0f %9.0f %9.0f %8.0f %7.0f %9.0f %7.0f %7.0f %7.0f "
+           "%9.0f %8.0f %7.0f %11s %5luus %5luus %9.2f %9.2f\n",
+           name, m->accepts * f, m->accept_drops * f, m->recvs * f,
+           m->sends * f, m->timeouts * f, m->buf_starved * f,
+           m->responses[2] * f, m->responses[3] * f, m->responses[4] * f,
+           m->responses[5] * f, m->upstream_requests * f,
+           m->upstream_connects * f, m->upstream_failures * f, pool, (unsigned long) percentile(m, 50),
+           (unsigned long) percentile(m, 99),
+           responses ? (double) m->enters / responses : 0,
+           m->enters ? (double) m->sqes / m->enters : 0);
+}
+
+static void report(const metrics_worker_t *cur,
+                   const metrics_worker_t *prev,
+                   double secs,
+                   bool per_worker)
+{
+    metrics_worker_t total, d;
+    char name[16];
+
+    memset(&total, 0, sizeof(total));
+    for (unsigned i = 0; i < shm->nr_workers; i++) {
+        if (prev)
+            diff(&d, &cur[i], &prev[i]);
+        else
+            d = cur[i];
+        sum(&total, &d);
+        if (per_worker) {
+            snprintf(name, sizeof(name), "%u", i);
+            line(name, &d, secs);
+        }
+    }
+    line("all", &total, secs);
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 0;
+    long count = -1;
+    bool per_worker = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:wh")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'w':
+            per_worker = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (interval < 0 || attach() < 0)
+        return 1;
+
+    unsigned n = shm->nr_workers;
+    metrics_worker_t *cur = calloc(n, sizeof(metrics_worker_t));
+    metrics_worker_t *prev = calloc(n, sizeof(metrics_worker_t));
+    if (!cur || !prev)
+        return 1;
+
+    for (unsigned i = 0; i < n; i++)
+        snapshot(&cur[i], i);
+    if (interval == 0) {
+        printf("pid %d, %u worker(s), up %lds; totals, latency per "
+               "response\n",
+               shm->pid, n, (long) (time(NULL) - shm->started));
+        header();
+        report(cur, NULL, 0, per_worker);
+        return 0;
+    }
+
+    struct timespec ts = {.tv_sec = interval,
+                          .tv_nsec = (interval - (long) interval) * 1e9};
+    for (long round = 0; count < 0 || round < count; round++) {
+        metrics_worker_t *t = prev;
+        prev = cur;
+        cur = t;
+        nanosleep(&ts, NULL);
+        for (unsigned i = 0; i < n; i++)
+            snapshot(&cur[i], i);
+        if (round % 20 == 0)
+            header();
+        report(cur, prev, interval, per_worker);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <time.h>
+
+#include "timer.h"
+
+/* Two-level timer wheel. Level 0 has one slot per tick; level 1 has one
+ * slot per lap of level 0 and is cascaded down a slot at a time as level 0
+ * wraps. Arming, re-arming and cancelling are O(1), and a tick only looks
+ * at the connections that actually expire in it, so thousands of idle
+ * connections cost nothing until their time is up.
+ */
+#define L0_BITS 8
+#define L1_BITS 6
+#define L0_SIZE (1 << L0_BITS)
+#define L1_SIZE (1 << L1_BITS)
+#define L0_MASK (L0_SIZE - 1)
+#define L1_MASK (L1_SIZE - 1)
+/* longest delay level 1 can hold without wrapping onto the slot being
+ * cascaded; a timer further out waits in the last slot and is queued again
+ * for the time left when that slot comes down
+ */
+#define MAX_DELAY (((uint64_t) L1_SIZE - 1) << L0_BITS)
+
+static unsigned timeouts[TIMER_KINDS] = {
+    [TIMER_HEADER] = TIMER_DEFAULT_HEADER_MSEC,
+    [TIMER_IDLE] = TIMER_DEFAULT_IDLE_MSEC,
+    [TIMER_WRITE] = TIMER_DEFAULT_WRITE_MSEC,
+};
+
+/* every worker runs its own wheel */
+static __thread struct list_head level0[L0_SIZE], level1[L1_SIZE];
+static __thread uint64_t now_tick; /* next tick to be run */
+static __thread uint64_t start_msec;
+
+static uint64_t monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void timer_set_timeout(enum timer_kind kind, unsigned msec)
+{
+    timeouts[kind] = msec;
+}
+
+unsigned timer_get_timeout(enum timer_kind kind)
+{
+    return timeouts[kind];
+}
+
+void timer_init()
+{
+    for (int i = 0; i < L0_SIZE; i++)
+        INIT_LIST_HEAD(&level0[i]);
+    for (int i = 0; i < L1_SIZE; i++)
+        INIT_LIST_HEAD(&level1[i]);
+    now_tick = 0;
+    start_msec = monotonic_msec();
+}
+
+static void enqueue(timer_node_t *t)
+{
+    uint64_t delay = t->expires - now_tick;
+    uint64_t slot = t->expires;
+
+    if (delay < L0_SIZE) {
+        list_add_tail(&t->link, &level0[t->expires & L0_MASK]);
+        return;
+    }
+    if (delay > MAX_DELAY)
+        slot = now_tick + MAX_DELAY;
+    list_add_tail(&t->link, &level1[(slot >> L0_BITS) & L1_MASK]);
+}
+
+/* Ticks only advance in timer_tick(), so a deadline may be counted from up
+ * to one tick in the past; the extra tick makes sure it never fires early.
+ */
+void timer_arm(timer_node_t *t, enum timer_kind kind)
+{
+    if (t->armed)
+        list_del(&t->link);
+    t->expires =
+        now_tick + (timeouts[kind] + TIMER_TICK_MSEC - 1) / TIMER_TICK_MSEC + 1;
+    t->armed = true;
+    t->kind = kind;
+    enqueue(t);
+}
+
+void timer_cancel(timer_node_t *t)
+{
+    if (!t->armed)
+        return;
+    list_del(&t->link);
+    t->armed = false;
+}
+
+static void move_list(struct list_head *to, struct list_head *from)
+{
+    INIT_LIST_HEAD(to);
+    if (list_empty(from))
+        return;
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    INIT_LIST_HEAD(from);
+}
+
+/* Run every tick up to now and hand the expired timers to @expire in one
+ * batch per tick. A timer is disarmed before its callback, which may arm it
+ * again or free the object it is embedded in.
+ */
+void timer_tick(timer_expire_fn expire)
+{
+    uint64_t target = (monotonic_msec() - start_msec) / TIMER_TICK_MSEC;
+    struct list_head batch;
+
+    while (now_tick <= target) {
+        unsigned idx = now_tick & L0_MASK;
+
+        if (!idx) {
+            move_list(&batch, &level1[(now_tick >> L0_BITS) & L1_MASK]);
+            while (!list_empty(&batch)) {
+                timer_node_t *t = list_entry(batch.next, timer_node_t, link);
+                list_del(&t->link);
+                enqueue(t);
+            }
+        }
+
+        move_list(&batch, &level0[idx]);
+        now_tick++;
+        while (!list_empty(&batch)) {
+            timer_node_t *t = list_entry(batch.next, timer_node_t, link);
+            list_del(&t->link);
+            t->armed = false;
+            expire(t);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
+#define TIMER_TICK_MSEC 100
+
+/* what a connection is waiting for; each kind has its own timeout */
+enum timer_kind {
+    TIMER_HEADER, /* the client to send (the rest of) a request */
+    TIMER_IDLE,   /* the next request on a kept-alive connection */
+    TIMER_WRITE,  /* the client to drain a response */
+    TIMER_KINDS
+};
+
+#define TIMER_DEFAULT_HEADER_MSEC 1500
+#define TIMER_DEFAULT_IDLE_MSEC 5000
+#define TIMER_DEFAULT_WRITE_MSEC 10000
+
+/* Embedded in the object it times; one deadline at a time. */
+typedef struct {
+    struct list_head link;
+    uint64_t expires; /* in ticks */
+    bool armed;
+    uint8_t kind;
+} timer_node_t;
+
+typedef void (*timer_expire_fn)(timer_node_t *t);
+
+/* process wide, set before the workers start */
+void timer_set_timeout(enum timer_kind kind, unsigned msec);
+unsigned timer_get_timeout(enum timer_kind kind);
+
+void timer_init();
+void timer_arm(timer_node_t *t, enum timer_kind kind);
+void timer_cancel(timer_node_t *t);
+void timer_tick(timer_expire_fn expire);
+
+#endif
@@ -3,17 +3,35 @@
 #include <liburing.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
+#include "file_cache.h"
+#include "metrics.h"
+#include "probes.h"
+#include "proxy.h"
 #include "uring.h"
 
-#define TIMEOUT_MSEC 1500
 #define MAX_CONNECTIONS 2048
-#define MAX_MESSAGE_LEN 4096
-char bufs[MAX_CONNECTIONS][MAX_MESSAGE_LEN] = {0};
-int group_id = 8888;
+#define SPLICE_CHUNK 65536 /* default pipe capacity */
+/* Every worker thread owns its ring and its provided-buffer group, so
+ * nothing here is shared between event loops.
+ */
+static __thread char (*bufs)[MAX_MESSAGE_LEN];
+static int group_id = 8888;
 
-struct io_uring ring;
+/* Registered buffer ring; NULL when the kernel lacks it and buffers are
+ * handed back with IORING_OP_PROVIDE_BUFFERS instead.
+ */
+static __thread struct io_uring_buf_ring *buf_ring;
+static __thread int buf_ring_mask;
+
+/* client sockets live in the registered file table, see add_accept_direct();
+ * the number of slots in it, 0 without one
+ */
+static __thread unsigned fixed_files;
+
+static __thread struct io_uring ring;
 
 static void msec_to_ts(struct __kernel_timespec *ts, unsigned int msec)
 {
@@ -21,14 +39,78 @@ static void msec_to_ts(struct __kernel_timespec *ts, unsigned int msec)
     ts->tv_nsec = (msec % 1000) * 1000000;
 }
 
-void init_io_uring()
+static inline unsigned fd_flags(http_request_t *r)
+{
+    return r->fixed_file ? IOSQE_FIXED_FILE : 0;
+}
+
+const char *const ring_profile_names[] = {
+    [RING_DEFAULT] = "default",
+    [RING_SQPOLL] = "sqpoll",
+    [RING_COOP] = "coop",
+    [RING_DEFER] = "defer",
+};
+
+static int setup_ring(const ring_params_t *rp, struct io_uring_params *params)
+{
+    memset(params, 0, sizeof(*params));
+    switch (rp->profile) {
+    case RING_SQPOLL:
+        params->flags = IORING_SETUP_SQPOLL;
+        params->sq_thread_idle = rp->sq_idle;
+        if (rp->sq_cpu >= 0) {
+            params->flags |= IORING_SETUP_SQ_AFF;
+            params->sq_thread_cpu = rp->sq_cpu;
+        }
+        break;
+    case RING_COOP:
+        /* TASKRUN_FLAG tells liburing when it has to enter for completions */
+        params->flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        break;
+    case RING_DEFER:
+        /* the ring never leaves the worker that created it */
+        params->flags =
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        break;
+    default:
+        break;
+    }
+    return io_uring_queue_init_params(Queue_Depth, &ring, params);
+}
+
+/* The kernel refuses a file table larger than RLIMIT_NOFILE, even though
+ * its slots are no open files. Raise the soft limit as far as the hard one
+ * goes and settle for a smaller table beyond that.
+ */
+static unsigned fixed_files_limit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return FIXED_FILES;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur < FIXED_FILES ? rl.rlim_cur : FIXED_FILES;
+}
+
+/* Kernels that predate a profile reject its flags with -EINVAL, and SQPOLL
+ * may need privileges; those workers run with the default setup instead.
+ */
+void init_io_uring(bool direct, const ring_params_t *rp)
 {
     printf("Queue_Depth = %d\n", Queue_Depth);
 
     struct io_uring_params params;
-    memset(&params, 0, sizeof(params));
 
-    int ret = io_uring_queue_init_params(Queue_Depth, &ring, &params);
+    int ret = setup_ring(rp, &params);
+    if (ret < 0 && rp->profile != RING_DEFAULT) {
+        printf("%s ring not supported (%s), using default\n",
+               ring_profile_names[rp->profile], strerror(-ret));
+        ret = setup_ring(&(ring_params_t){.profile = RING_DEFAULT}, &params);
+    }
     assert(ret >= 0 && "io_uring_queue_init");
 
     if (!(params.features & IORING_FEAT_FAST_POLL)) {
@@ -37,6 +119,39 @@ void init_io_uring()
         exit(0);
     }
 
+    /* Slot i of the table belongs to pool object i; the multishot engine
+     * lets the kernel pick slots from the same range.
+     */
+    if (direct) {
+        unsigned slots = fixed_files_limit();
+        if (io_uring_register_files_sparse(&ring, slots) == 0 &&
+            io_uring_register_file_alloc_range(&ring, 0, slots) == 0)
+            fixed_files = slots;
+        else
+            printf("Registered file table not supported, using plain fds\n");
+        if (fixed_files && fixed_files < FIXED_FILES)
+            printf("Registered file table limited to %u slots by "
+                   "RLIMIT_NOFILE\n",
+                   fixed_files);
+    }
+
+    bufs = calloc(MAX_CONNECTIONS, MAX_MESSAGE_LEN);
+    if (!bufs) {
+        printf("Buffer group calloc fail\n");
+        exit(1);
+    }
+
+    buf_ring = io_uring_setup_buf_ring(&ring, MAX_CONNECTIONS, group_id, 0,
+                                       &ret);
+    if (buf_ring) {
+        buf_ring_mask = io_uring_buf_ring_mask(MAX_CONNECTIONS);
+        for (int bid = 0; bid < MAX_CONNECTIONS; bid++)
+            io_uring_buf_ring_add(buf_ring, bufs[bid], MAX_MESSAGE_LEN, bid,
+                                  buf_ring_mask, bid);
+        io_uring_buf_ring_advance(buf_ring, MAX_CONNECTIONS);
+        return;
+    }
+
     struct io_uring_probe *probe;
     probe = io_uring_get_probe_ring(&ring);
     if (!probe ||
@@ -67,82 +182,291 @@ struct io_uring *get_ring()
     return &ring;
 }
 
+unsigned uring_fixed_files()
+{
+    return fixed_files;
+}
+
+/* liburing only calls io_uring_enter() to wait, when there is something to
+ * submit, and with SQPOLL only when the poller has gone to sleep; count the
+ * calls the way it makes them.
+ */
+static void submit(unsigned wait_nr)
+{
+    if (wait_nr ||
+        (io_uring_sq_ready(&ring) &&
+         (!(ring.flags & IORING_SETUP_SQPOLL) ||
+          (IO_URING_READ_ONCE(*ring.sq.kflags) & IORING_SQ_NEED_WAKEUP))))
+        METRICS_INC(enters);
+
+    int ret = io_uring_submit_and_wait(&ring, wait_nr);
+    if (ret > 0)
+        METRICS_ADD(sqes, ret);
+}
+
+/* The add_*() helpers only queue SQEs; the event loop hands all of them to
+ * the kernel at once in submit_and_wait(). Should a burst of completions
+ * fill the SQ first, what is queued so far goes out on the spot.
+ */
+static void reserve_sqes(unsigned n)
+{
+    while (io_uring_sq_space_left(&ring) < n) {
+        submit(0);
+        /* the SQPOLL thread frees entries only as it gets to them */
+        if (ring.flags & IORING_SETUP_SQPOLL)
+            io_uring_sqring_wait(&ring);
+    }
+}
+
+static struct io_uring_sqe *get_sqe()
+{
+    reserve_sqes(1);
+    return io_uring_get_sqe(&ring);
+}
+
 void submit_and_wait()
 {
-    io_uring_submit_and_wait(&ring, 1);
+    submit(1);
 }
 
-void add_accept(struct io_uring *ring,
-                int fd,
+void add_accept(int fd,
                 struct sockaddr *client_addr,
                 socklen_t *client_len,
                 http_request_t *req)
 {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    struct io_uring_sqe *sqe = get_sqe();
     io_uring_prep_accept(sqe, fd, client_addr, client_len, 0);
     io_uring_sqe_set_flags(sqe, 0);
-    req->event_type = accept;
     req->fd = fd;
-    io_uring_sqe_set_data(sqe, req);
+    io_uring_sqe_set_data64(sqe, event_pack(req, accept));
 }
 
 
 void add_read_request(http_request_t *request)
 {
     int clientfd = request->fd;
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    struct io_uring_sqe *sqe = get_sqe();
     io_uring_prep_recv(sqe, clientfd, NULL, MAX_MESSAGE_LEN, 0);
-    io_uring_sqe_set_flags(sqe, (IOSQE_BUFFER_SELECT | IOSQE_IO_LINK));
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT | fd_flags(request));
     sqe->buf_group = group_id;
+    request->recv_armed = true;
+    io_uring_sqe_set_data64(sqe, event_pack(request, read));
+}
 
-    request->event_type = read;
-    io_uring_sqe_set_data(sqe, request);
+/* Accept straight into slot @slot of the registered file table; the CQE
+ * then carries 0 instead of a descriptor.
+ */
+void add_accept_direct(int fd, http_request_t *req, unsigned slot)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_accept_direct(sqe, fd, NULL, NULL, 0, slot);
+    req->fd = fd;
+    io_uring_sqe_set_data64(sqe, event_pack(req, accept));
+}
 
-    struct __kernel_timespec ts;
-    msec_to_ts(&ts, TIMEOUT_MSEC);
-    sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_link_timeout(sqe, &ts, 0);
-    http_request_t *timeout_req = get_request();
-    timeout_req->event_type = uring_timer;
-    io_uring_sqe_set_data(sqe, timeout_req);
-    io_uring_submit(&ring);
+/* With direct descriptors the kernel picks a free slot and reports it in
+ * the CQE.
+ */
+void add_multishot_accept(int fd, http_request_t *req)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (fixed_files)
+        io_uring_prep_multishot_accept_direct(sqe, fd, NULL, NULL, 0);
+    else
+        io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, 0);
+    req->fd = fd;
+    io_uring_sqe_set_data64(sqe, event_pack(req, accept));
+}
+
+/* Stays armed across requests and picks a fresh provided buffer for every
+ * completion.
+ */
+void add_multishot_read(http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_recv_multishot(sqe, r->fd, NULL, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT | fd_flags(r));
+    sqe->buf_group = group_id;
+    r->recv_armed = true;
+    io_uring_sqe_set_data64(sqe, event_pack(r, read));
+}
+
+/* Stop a multishot recv; it ends with a last completion, -ECANCELED or
+ * one that was already on its way.
+ */
+void add_cancel_read(http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_cancel64(sqe, event_pack(r, read), 0);
+    io_uring_sqe_set_data64(sqe, event_pack(NULL, detached));
+}
+
+void add_write_request(void *usrbuf, size_t len, http_request_t *r)
+{
+    r->iov[0].iov_base = usrbuf;
+    r->iov[0].iov_len = len;
+    r->iovcnt = 1;
+    add_send_request(r);
+}
+
+/* Send r->iov; a single buffer goes out as a plain send, several as one
+ * sendmsg so header and cached body still cost a single SQE.
+ */
+void add_send_request(http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    PROBE2(sending, r, r->iovcnt);
+    if (r->iovcnt == 1) {
+        io_uring_prep_send(sqe, r->fd, r->iov[0].iov_base, r->iov[0].iov_len,
+                           0);
+    } else {
+        memset(&r->msg, 0, sizeof(r->msg));
+        r->msg.msg_iov = r->iov;
+        r->msg.msg_iovlen = r->iovcnt;
+        io_uring_prep_sendmsg(sqe, r->fd, &r->msg, 0);
+    }
+    io_uring_sqe_set_flags(sqe, fd_flags(r));
+    io_uring_sqe_set_data64(sqe, event_pack(r, write));
 }
 
-void add_write_request(void *usrbuf, http_request_t *r)
+/* Send the next chunk of the file body. Bytes left in the pipe by a short
+ * send are flushed before more of the file is pulled in, so the loop never
+ * waits on the disk or on a slow client.
+ */
+void add_splice_request(http_request_t *r)
 {
-    char *bufp = usrbuf;
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (r->pipe_len > 0) {
+        io_uring_prep_splice(sqe, r->pipefd[0], -1, r->fd, -1, r->pipe_len,
+                             0);
+        io_uring_sqe_set_flags(sqe, fd_flags(r));
+        io_uring_sqe_set_data64(sqe, event_pack(r, splice_out));
+    } else {
+        size_t len = r->file_left < SPLICE_CHUNK ? r->file_left : SPLICE_CHUNK;
+        /* a proxied body never takes more than the response from the
+         * upstream socket, the connection stays usable
+         */
+        if (r->upstream)
+            io_uring_prep_splice(sqe, r->upstream->fd, -1, r->pipefd[1], -1,
+                                 len, 0);
+        else
+            io_uring_prep_splice(sqe, r->file->fd, r->file_off, r->pipefd[1],
+                                 -1, len, 0);
+        io_uring_sqe_set_data64(sqe, event_pack(r, splice_in));
+    }
+}
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    http_request_t *request = r;
-    request->event_type = write;
-    unsigned long len = strlen(bufp);
+/* Connect to an upstream, giving up after @msec. The timeout is linked to
+ * the connect, so both have to go out in the same submission.
+ */
+void add_connect(int fd,
+                 const struct sockaddr *addr,
+                 socklen_t addr_len,
+                 unsigned msec,
+                 http_request_t *r)
+{
+    static __thread struct __kernel_timespec ts;
 
-    io_uring_prep_send(sqe, r->fd, bufp, len, 0);
+    reserve_sqes(2);
+    msec_to_ts(&ts, msec);
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_connect(sqe, fd, addr, addr_len);
     io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
-    io_uring_sqe_set_data(sqe, request);
+    io_uring_sqe_set_data64(sqe, event_pack(r, upstream_connect));
 
-    struct __kernel_timespec ts;
-    msec_to_ts(&ts, TIMEOUT_MSEC);
-    sqe = io_uring_get_sqe(&ring);
+    sqe = get_sqe();
     io_uring_prep_link_timeout(sqe, &ts, 0);
-    io_uring_sqe_set_flags(sqe, 0);
-    http_request_t *timeout_req = get_request();
-    assert(timeout_req && "malloc fault");
-    timeout_req->event_type = uring_timer;
-    io_uring_sqe_set_data(sqe, timeout_req);
-    io_uring_submit(&ring);
+    io_uring_sqe_set_data64(sqe, event_pack(NULL, detached));
+}
+
+/* Upstream sockets are plain descriptors; the completions go to the client
+ * request the exchange is for.
+ */
+void add_upstream_send(int fd, const void *buf, size_t len, http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, event_pack(r, upstream_send));
+}
+
+void add_upstream_recv(int fd, void *buf, size_t len, http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_recv(sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data64(sqe, event_pack(r, upstream_recv));
+}
+
+/* Closing or shutting down a direct descriptor has to go through the ring.
+ * Nobody waits for the result, so the CQE is tagged with no request.
+ */
+void add_close_direct(int slot)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_close_direct(sqe, slot);
+    io_uring_sqe_set_data64(sqe, event_pack(NULL, detached));
+}
+
+void add_shutdown_request(http_request_t *r)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_shutdown(sqe, r->fd, SHUT_RDWR);
+    io_uring_sqe_set_flags(sqe, fd_flags(r));
+    io_uring_sqe_set_data64(sqe, event_pack(NULL, detached));
+}
+
+void add_inotify_read(int fd, void *buf, unsigned len, http_request_t *req)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_read(sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data64(sqe, event_pack(req, inotify));
+}
+
+/* Fire on the next wall-clock second so the cached Date: header is never
+ * more than one loop iteration stale.
+ */
+void add_clock_timer(http_request_t *req)
+{
+    static __thread struct __kernel_timespec ts;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    msec_to_ts(&ts, 1000 - now.tv_usec / 1000);
+
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &ts, 0, 0);
+    io_uring_sqe_set_data64(sqe, event_pack(req, clock_tick));
+}
+
+/* Drives the connection timer wheel, see timer.c. */
+void add_tick_timer(http_request_t *req)
+{
+    static __thread struct __kernel_timespec ts;
+
+    msec_to_ts(&ts, TIMER_TICK_MSEC);
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &ts, 0, 0);
+    io_uring_sqe_set_data64(sqe, event_pack(req, uring_timer));
 }
 
 void add_provide_buf(int bid)
 {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (buf_ring) {
+        /* no SQE: publishing the buffer is a store to the ring tail */
+        io_uring_buf_ring_add(buf_ring, bufs[bid], MAX_MESSAGE_LEN, bid,
+                              buf_ring_mask, 0);
+        io_uring_buf_ring_advance(buf_ring, 1);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe();
     io_uring_prep_provide_buffers(sqe, bufs[bid], MAX_MESSAGE_LEN, 1, group_id,
                                   bid);
     io_uring_sqe_set_flags(sqe, 0);
     http_request_t *req = get_request();
     assert(req && "malloc fault");
-    req->event_type = prov_buf;
-    io_uring_sqe_set_data(sqe, req);
+    io_uring_sqe_set_data64(sqe, event_pack(req, prov_buf));
 }
 
 void uring_cq_advance(int count)
@@ -152,7 +476,10 @@ void uring_cq_advance(int count)
 
 void uring_queue_exit()
 {
-    return io_uring_queue_exit(&ring);
+    if (buf_ring)
+        io_uring_free_buf_ring(&ring, buf_ring, MAX_CONNECTIONS, group_id);
+    io_uring_queue_exit(&ring);
+    free(bufs);
 }
 
 void *get_bufs(int bid)
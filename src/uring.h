@@ -2,23 +2,92 @@
 #include "memory_pool.h"
 
 #define Queue_Depth 8192
+#define FIXED_FILES POOL_MAX_OBJECTS /* one table slot per pool object */
+#define MAX_MESSAGE_LEN 4096 /* size of a provided receive buffer */
 
 #define accept 0
 #define read 1
 #define write 2
 #define prov_buf 3
 #define uring_timer 4
+#define splice_in 5
+#define splice_out 6
+#define inotify 7
+#define clock_tick 8
+#define detached 9
+#define upstream_connect 10
+#define upstream_send 11
+#define upstream_recv 12
+
+/* The event type travels in the top byte of user_data rather than in the
+ * request, so one connection can have a multishot recv and a send in flight
+ * at the same time.
+ */
+#define EVENT_SHIFT 56
+
+static inline unsigned long long event_pack(http_request_t *r, int type)
+{
+    return (unsigned long long) (uintptr_t) r |
+           ((unsigned long long) type << EVENT_SHIFT);
+}
+
+static inline http_request_t *event_request(unsigned long long user_data)
+{
+    return (http_request_t *) (uintptr_t) (user_data &
+                                           ((1ULL << EVENT_SHIFT) - 1));
+}
+
+static inline int event_type(unsigned long long user_data)
+{
+    return user_data >> EVENT_SHIFT;
+}
+
+/* How the ring is set up, see init_io_uring(). */
+typedef enum {
+    RING_DEFAULT,
+    RING_SQPOLL, /* a kernel thread polls the SQ, submission is a store */
+    RING_COOP,   /* completion work waits for the next io_uring_enter() */
+    RING_DEFER,  /* ... and runs only when we ask for completions */
+} ring_profile_t;
+
+typedef struct {
+    ring_profile_t profile;
+    int sq_cpu;       /* SQPOLL: CPU the poller is pinned to, or -1 */
+    unsigned sq_idle; /* SQPOLL: msec without work before the poller sleeps */
+} ring_params_t;
+
+#define SQPOLL_DEFAULT_IDLE_MSEC 1000
+
+extern const char *const ring_profile_names[];
 
 struct io_uring *get_ring();
-void init_io_uring();
+void init_io_uring(bool direct, const ring_params_t *rp);
+unsigned uring_fixed_files(); /* slots in the file table, 0 if none */
 void submit_and_wait();
 void add_read_request(http_request_t *request);
-void add_accept(struct io_uring *ring,
-                int fd,
+void add_accept_direct(int fd, http_request_t *req, unsigned slot);
+void add_multishot_accept(int fd, http_request_t *req);
+void add_multishot_read(http_request_t *r);
+void add_accept(int fd,
                 struct sockaddr *client_addr,
                 socklen_t *client_len,
                 http_request_t *req);
-void add_write_request(void *usrbuf, http_request_t *r);
+void add_write_request(void *usrbuf, size_t len, http_request_t *r);
+void add_send_request(http_request_t *r);
+void add_clock_timer(http_request_t *req);
+void add_tick_timer(http_request_t *req);
+void add_splice_request(http_request_t *r);
+void add_connect(int fd,
+                 const struct sockaddr *addr,
+                 socklen_t addr_len,
+                 unsigned msec,
+                 http_request_t *r);
+void add_upstream_send(int fd, const void *buf, size_t len, http_request_t *r);
+void add_upstream_recv(int fd, void *buf, size_t len, http_request_t *r);
+void add_close_direct(int slot);
+void add_shutdown_request(http_request_t *r);
+void add_cancel_read(http_request_t *r);
+void add_inotify_read(int fd, void *buf, unsigned len, http_request_t *req);
 void add_provide_buf(int bid);
 void uring_cq_advance(int count);
 void uring_queue_exit();